@@ -0,0 +1,79 @@
+#include "tinyintegerexpr.h"
+#include <stdio.h>
+#include <time.h>
+#include "aot_rules.h"
+
+/* Compares code generated by tiec (see the aot_bench target in the Makefile)
+ * with tie_eval and tie_eval_batch on the same expressions. */
+
+#define ROWS (1 << 16)
+#define loops 200
+
+typedef int (*scalar_rule)(const int *);
+typedef void (*batch_rule)(const int *const *, int *, int);
+
+static int as[ROWS], bs[ROWS], cs[ROWS], out[ROWS], expected[ROWS];
+
+static int elapsed(clock_t start) {
+    return (int)((clock() - start) * 1000 / CLOCKS_PER_SEC);
+}
+
+void bench(const char *source, scalar_rule scalar, batch_rule batch) {
+    int vars[3];
+    tie_variable lk[] = {{"a", &vars[0]}, {"b", &vars[1]}, {"c", &vars[2]}};
+    tie_column columns[] = {{&vars[0], as}, {&vars[1], bs}, {&vars[2], cs}, {0, 0}};
+    const int *const cols[] = {as, bs, cs};
+    int i, j, bad = 0;
+    clock_t start;
+
+    printf("Expression: %s\n", source);
+    tie_expression *n = tie_compile(source, lk, 3, 0);
+
+    start = clock();
+    for (j = 0; j < loops; ++j)
+        for (i = 0; i < ROWS; ++i) {
+            vars[0] = as[i]; vars[1] = bs[i]; vars[2] = cs[i];
+            expected[i] = tie_eval(n);
+        }
+    printf("interp   %5dms\n", elapsed(start));
+
+    start = clock();
+    for (j = 0; j < loops; ++j)
+        tie_eval_batch(n, columns, ROWS, out);
+    printf("batch    %5dms\n", elapsed(start));
+
+    start = clock();
+    for (j = 0; j < loops; ++j)
+        for (i = 0; i < ROWS; ++i) {
+            vars[0] = as[i]; vars[1] = bs[i]; vars[2] = cs[i];
+            out[i] = scalar(vars);
+        }
+    printf("native   %5dms\n", elapsed(start));
+    for (i = 0; i < ROWS; ++i) bad += out[i] != expected[i];
+
+    start = clock();
+    for (j = 0; j < loops; ++j)
+        batch(cols, out, ROWS);
+    printf("native[] %5dms\n", elapsed(start));
+    for (i = 0; i < ROWS; ++i) bad += out[i] != expected[i];
+
+    if (bad) printf("MISMATCH in %d rows\n", bad);
+    printf("\n");
+    tie_free(n);
+}
+
+int main(int argc, char *argv[])
+{
+    int i;
+    for (i = 0; i < ROWS; ++i) {
+        as[i] = i % 1000 - 500;
+        bs[i] = (i * 7) % 301;
+        cs[i] = i;
+    }
+
+    bench(score_source, score, score_batch);
+    bench(mask_source, mask, mask_batch);
+    bench(pick_source, pick, pick_batch);
+
+    return 0;
+}
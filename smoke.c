@@ -24,6 +24,12 @@
 
 #include "tinyintegerexpr.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <unistd.h>
 #include "minctest.h"
 
 
@@ -257,9 +263,13 @@ void test_variables() {
   lok(!expr7);
   lok(err);
 
-  tie_expression *expr8 = tie_compile("x<<y", lookup, 2, &err);
+  tie_expression *expr8 = tie_compile("x<>y", lookup, 2, &err);
   lok(!expr8);
   lok(err);
+
+  tie_expression *expr9 = tie_compile("x=y", lookup, 2, &err);
+  lok(!expr9);
+  lok(err);
 }
 
 
@@ -482,6 +492,1611 @@ void test_optimize() {
   }
 }
 
+void test_checked() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x},
+                           {"y", &y}};
+
+  typedef struct {
+    const char *expr;
+    int x, y;
+    int answer;
+    int error;
+  } checked_case;
+
+  checked_case cases[] = {
+      {"x+y",  1,       2,  3,       0},
+      {"x+y",  INT_MAX, 1,  INT_MIN, TIE_ERROR_OVERFLOW},
+      {"x-y",  INT_MIN, 1,  INT_MAX, TIE_ERROR_OVERFLOW},
+      {"x*y",  1 << 16, 1 << 16, 0,  TIE_ERROR_OVERFLOW},
+      {"-x",   INT_MIN, 0,  INT_MIN, TIE_ERROR_OVERFLOW},
+      {"x/y",  7,       2,  3,       0},
+      {"x/y",  7,       0,  0,       TIE_ERROR_DIVIDE},
+      {"x/y",  INT_MIN, -1, INT_MIN, TIE_ERROR_OVERFLOW},
+      {"x%y",  7,       0,  0,       TIE_ERROR_DIVIDE},
+      {"x%y",  INT_MIN, -1, 0,       0},
+      {"x<<y", 1,       4,  16,      0},
+      {"x<<y", 1,       31, INT_MIN, TIE_ERROR_OVERFLOW},
+      {"x<<y", 1,       32, 1,       TIE_ERROR_SHIFT},
+      {"x>>y", -8,      40, -1,      TIE_ERROR_SHIFT},
+      {"(x/y)+(x*x)", 1 << 20, 0, 0, TIE_ERROR_DIVIDE | TIE_ERROR_OVERFLOW},
+      {"(x/y)*0", 7,      0,  0,       TIE_ERROR_DIVIDE},
+      {"0&(x/y)", 7,      0,  0,       TIE_ERROR_DIVIDE},
+      {"(x/y),3", 7,      0,  3,       TIE_ERROR_DIVIDE},
+  };
+
+  int i;
+  for (i = 0; i < sizeof(cases) / sizeof(checked_case); ++i) {
+    int err;
+    tie_expression *ex = tie_compile(cases[i].expr, lookup, 2, &err);
+    lok(ex);
+
+    x = cases[i].x;
+    y = cases[i].y;
+    lequal(tie_eval_checked(ex, &err), cases[i].answer);
+    lequal(err, cases[i].error);
+    tie_free(ex);
+  }
+
+  /* Constant folding must not trap either. */
+  int err;
+  tie_expression *ex = tie_compile("1/0", 0, 0, &err);
+  lok(ex);
+  tie_eval_checked(ex, &err);
+  lequal(err, TIE_ERROR_DIVIDE);
+  tie_free(ex);
+}
+
+
+void test_batch() {
+
+  int x, y, z;
+  tie_variable lookup[] = {{"x", &x},
+                           {"y", &y},
+                           {"z", &z}};
+
+  enum { ROWS = 3000 };
+  static int xs[ROWS], ys[ROWS], out[ROWS];
+  static unsigned char mask[(ROWS + 7) / 8];
+
+  int i;
+  for (i = 0; i < ROWS; ++i) {
+    xs[i] = i - ROWS / 2;
+    ys[i] = (i * 7) % 13 - 6;
+  }
+
+  tie_column columns[] = {{&x, xs}, {&y, ys}, {0, 0}};
+
+  const char *exprs[] = {
+      "x+y*z",
+      "(x-y)&(x|y)^z",
+      "if(y, x/(y+7), -x) + sum2(x, y)",
+      "x, y, z",
+  };
+
+  tie_variable dynamic[] = {{"x", &x}, {"y", &y}, {"z", &z}, {"sum2", sum2, TIE_FUNCTION2}};
+
+  int e;
+  for (e = 0; e < sizeof(exprs) / sizeof(const char *); ++e) {
+    int err;
+    tie_expression *ex = tie_compile(exprs[e], dynamic, 4, &err);
+    lok(ex);
+
+    z = 5;
+    lequal(tie_eval_batch(ex, columns, ROWS, out), 0);
+
+    int bad = 0;
+    for (i = 0; i < ROWS; ++i) {
+      x = xs[i];
+      y = ys[i];
+      if (out[i] != tie_eval(ex)) ++bad;
+    }
+    lequal(bad, 0);
+    tie_free(ex);
+  }
+
+  /* Checked batches flag exactly the rows that divide by zero. */
+  int err;
+  tie_expression *ex = tie_compile("x/y", lookup, 3, &err);
+  lequal(tie_eval_batch_checked(ex, columns, ROWS, out, mask), TIE_ERROR_DIVIDE);
+
+  int bad = 0;
+  for (i = 0; i < ROWS; ++i) {
+    const int flagged = (mask[i / 8] >> (i % 8)) & 1;
+    if (flagged != (ys[i] == 0)) ++bad;
+    if (!flagged && out[i] != xs[i] / ys[i]) ++bad;
+  }
+  lequal(bad, 0);
+  tie_free(ex);
+}
+
+
+static int batch_calls;
+
+void sum2_batch(void *context, const int *const *args, int *out, int count) {
+  int i;
+  ++batch_calls;
+  for (i = 0; i < count; ++i) out[i] = args[0][i] + args[1][i];
+}
+
+void cell_batch(void *context, const int *const *args, int *out, int count) {
+  const int *c = context;
+  int i;
+  ++batch_calls;
+  for (i = 0; i < count; ++i) out[i] = c[args[0][i]];
+}
+
+void test_batch_functions() {
+
+  int x;
+  int c[] = {5, 6, 7, 8, 9};
+  tie_variable lookup[] = {
+      {"x",    &x},
+      {"sum2", sum2, TIE_FUNCTION2, 0, sum2_batch},
+      {"cell", cell, TIE_CLOSURE1,  c, cell_batch},
+  };
+
+  enum { ROWS = 2500 };
+  static int xs[ROWS], out[ROWS];
+  int i;
+  for (i = 0; i < ROWS; ++i) xs[i] = i % 5;
+  tie_column columns[] = {{&x, xs}, {0, 0}};
+
+  int err;
+  tie_expression *ex = tie_compile("sum2(x, cell x) * 2", lookup, 3, &err);
+  lok(ex);
+
+  batch_calls = 0;
+  lequal(tie_eval_batch(ex, columns, ROWS, out), 0);
+  /* Once per block for each of the two functions. */
+  lequal(batch_calls, 2 * ((ROWS + 1023) / 1024));
+
+  int bad = 0;
+  for (i = 0; i < ROWS; ++i) {
+    x = xs[i];
+    if (out[i] != tie_eval(ex)) ++bad;
+  }
+  lequal(bad, 0);
+  lequal(batch_calls, 2 * ((ROWS + 1023) / 1024));
+  tie_free(ex);
+}
+
+
+void test_intrinsics() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x},
+                           {"y", &y}};
+
+  test_case cases[] = {
+      {"abs(-7)",            7},
+      {"abs 7",              7},
+      {"min(3, -4)",         -4},
+      {"max(3, -4)",         3},
+      {"clamp(15, 0, 10)",   10},
+      {"clamp(-5, 0, 10)",   0},
+      {"clamp(5, 0, 10)",    5},
+      {"popcount 255",       8},
+      {"popcount(-1)",       32},
+      {"clz 1",              31},
+      {"clz 0",              32},
+      {"ctz 8",              3},
+      {"ctz 0",              32},
+      {"bswap 1",            1 << 24},
+      {"rotl(1, 33)",        2},
+      {"rotr(1, 1)",         INT_MIN},
+      {"rotl(rotr(77, 5), 5)", 77},
+  };
+
+  int i;
+  for (i = 0; i < sizeof(cases) / sizeof(test_case); ++i) {
+    int err;
+    tie_expression *ex = tie_compile(cases[i].expr, 0, 0, &err);
+    lok(ex);
+
+    /* Intrinsics are pure, so constant arguments fold at compile time. */
+    lequal(ex->value, cases[i].answer);
+    tie_free(ex);
+  }
+
+  int err;
+  tie_expression *ex = tie_compile("abs x", lookup, 2, &err);
+  x = INT_MIN;
+  tie_eval_checked(ex, &err);
+  lequal(err, TIE_ERROR_OVERFLOW);
+  tie_free(ex);
+
+  enum { ROWS = 100 };
+  int xs[ROWS], ys[ROWS], out[ROWS];
+  for (i = 0; i < ROWS; ++i) {
+    xs[i] = (i - 50) * 12345;
+    ys[i] = i % 40 - 5;
+  }
+  tie_column columns[] = {{&x, xs}, {&y, ys}, {0, 0}};
+
+  ex = tie_compile("clamp(x, -y, y) + max(x, y) - min(x, y) ^ popcount x ^ clz y ^ ctz x ^ rotl(x, y) ^ rotr(y, x) ^ bswap x ^ abs x",
+                   lookup, 2, &err);
+  lok(ex);
+  lequal(tie_eval_batch(ex, columns, ROWS, out), 0);
+
+  int bad = 0;
+  for (i = 0; i < ROWS; ++i) {
+    x = xs[i];
+    y = ys[i];
+    if (out[i] != tie_eval(ex)) ++bad;
+  }
+  lequal(bad, 0);
+  tie_free(ex);
+}
+
+
+static int cache_x;
+static tie_variable cache_lookup[] = {{"x", &cache_x}};
+
+static void *cache_worker(void *arg) {
+  tie_cache *cache = arg;
+  char text[64];
+  int i, bad = 0;
+  for (i = 0; i < 2000; ++i) {
+    const int k = (i * 7) % 37;
+    snprintf(text, sizeof(text), "%d * 3 + %d", k, k);
+
+    int err;
+    tie_cache_entry *e = tie_cache_acquire(cache, text, &err);
+    if (!e || tie_eval(tie_cache_expression(e)) != k * 4) ++bad;
+    tie_cache_release(e);
+  }
+  return (void *) (long) bad;
+}
+
+void test_cache() {
+
+  tie_cache *cache = tie_cache_new(cache_lookup, 1, 4);
+  lok(cache);
+
+  int err;
+  tie_cache_entry *a = tie_cache_acquire(cache, "x + 1", &err);
+  tie_cache_entry *b = tie_cache_acquire(cache, " x+1 ", &err);
+  lok(a);
+  lok(a == b);
+
+  cache_x = 41;
+  lequal(tie_eval(tie_cache_expression(a)), 42);
+
+  /* Whitespace between words is significant. */
+  lok(!tie_cache_acquire(cache, "x 1", &err));
+  lequal(err, 3);
+
+  /* Evicting an acquired expression leaves it usable. */
+  int i;
+  const char *others[] = {"1", "2", "3", "4", "5"};
+  for (i = 0; i < 5; ++i) tie_cache_release(tie_cache_acquire(cache, others[i], &err));
+  lequal(tie_eval(tie_cache_expression(a)), 42);
+  tie_cache_release(a);
+  tie_cache_release(b);
+
+  tie_cache_stats stats;
+  tie_cache_get_stats(cache, &stats);
+  lequal((int) stats.hits, 1);
+  lequal((int) stats.misses, 7);
+  lequal((int) stats.evictions, 2);
+  lequal(stats.size, 4);
+  tie_cache_free(cache);
+
+  /* An entry that is hit outlives colder ones inserted after it. */
+  cache = tie_cache_new(cache_lookup, 1, 2);
+  tie_cache_release(tie_cache_acquire(cache, "1", &err));
+  tie_cache_release(tie_cache_acquire(cache, "2", &err));
+  tie_cache_release(tie_cache_acquire(cache, "1", &err));
+  tie_cache_release(tie_cache_acquire(cache, "3", &err));
+  tie_cache_release(tie_cache_acquire(cache, "1", &err));
+  tie_cache_get_stats(cache, &stats);
+  lequal((int) stats.hits, 2);
+  lequal((int) stats.misses, 3);
+  lequal((int) stats.evictions, 1);
+  tie_cache_free(cache);
+
+  /* Many threads sharing a cache that is too small, so entries churn. */
+  cache = tie_cache_new(cache_lookup, 1, 8);
+  pthread_t threads[8];
+  for (i = 0; i < 8; ++i) pthread_create(&threads[i], 0, cache_worker, cache);
+  int bad = 0;
+  for (i = 0; i < 8; ++i) {
+    void *ret;
+    pthread_join(threads[i], &ret);
+    bad += (int) (long) ret;
+  }
+  lequal(bad, 0);
+
+  tie_cache_get_stats(cache, &stats);
+  lequal((int) (stats.hits + stats.misses), 8 * 2000);
+  tie_cache_free(cache);
+}
+
+
+void test_ranges() {
+
+  int pct, e, x, y;
+  tie_range pct_range = {0, 100}, e_range = {0, 3};
+  tie_variable lookup[] = {{"pct", &pct, TIE_VARIABLE, 0, 0, 0, 0, &pct_range},
+                           {"e",   &e,   TIE_VARIABLE, 0, 0, 0, 0, &e_range},
+                           {"x",   &x},
+                           {"y",   &y}};
+
+  int err;
+  tie_expression *ex = tie_compile("pct*e+1", lookup, 4, &err);
+  tie_range r = tie_get_range(ex);
+  lequal(r.min, 1);
+  lequal(r.max, 301);
+  tie_free(ex);
+
+  ex = tie_compile("min(pct - 50, e) & 7", lookup, 4, &err);
+  r = tie_get_range(ex);
+  lequal(r.min, 0);
+  lequal(r.max, 7);
+  tie_free(ex);
+
+  ex = tie_compile("x + pct", lookup, 4, &err);
+  r = tie_get_range(ex);
+  lequal(r.min, INT_MIN);
+  lequal(r.max, INT_MAX);
+  tie_free(ex);
+
+  /* Statically decided ifs reduce to the branch taken. */
+  ex = tie_compile("if(pct + 1, x, y)", lookup, 4, &err);
+  lequal(ex->type, TIE_VARIABLE);
+  lok(ex->bound == &x);
+  tie_free(ex);
+
+  ex = tie_compile("if(e / 4, x, y)", lookup, 4, &err);
+  lequal(ex->type, TIE_VARIABLE);
+  lok(ex->bound == &y);
+  tie_free(ex);
+
+  ex = tie_compile("if(e, x, y)", lookup, 4, &err);
+  lok(ex->type != TIE_VARIABLE);
+  tie_free(ex);
+
+  /* Unless the branch not taken could trap. */
+  ex = tie_compile("if(pct + 1, x, x / y)", lookup, 4, &err);
+  lok(ex->type != TIE_VARIABLE);
+  y = 0;
+  tie_eval_checked(ex, &err);
+  lequal(err, TIE_ERROR_DIVIDE);
+  tie_free(ex);
+
+  /* Batches give the same results when narrow lanes and dropped checks kick in. */
+  enum { ROWS = 1500 };
+  static int pcts[ROWS], es[ROWS], xs[ROWS], out[ROWS], checked[ROWS];
+  static unsigned char mask[(ROWS + 7) / 8];
+  int i;
+  for (i = 0; i < ROWS; ++i) {
+    pcts[i] = i % 101;
+    es[i] = i % 4;
+    xs[i] = i * 1000 - 700000;
+  }
+  tie_column columns[] = {{&pct, pcts}, {&e, es}, {&x, xs}, {0, 0}};
+
+  const char *exprs[] = {
+      "pct*e - pct + (e ^ 1) * -3",
+      "max(pct, 7) * (e | 4) + -e",
+      "(pct*e - 20) * x / (e + 1)",
+      "x / (pct + 1) + (pct < e)",
+  };
+
+  int k;
+  for (k = 0; k < sizeof(exprs) / sizeof(const char *); ++k) {
+    ex = tie_compile(exprs[k], lookup, 4, &err);
+    lok(ex);
+    y = 3;
+    lequal(tie_eval_batch(ex, columns, ROWS, out), 0);
+    tie_eval_batch_checked(ex, columns, ROWS, checked, mask);
+
+    int bad = 0;
+    for (i = 0; i < ROWS; ++i) {
+      pct = pcts[i];
+      e = es[i];
+      x = xs[i];
+      int flags;
+      const int expected = tie_eval_checked(ex, &flags);
+      if (((mask[i / 8] >> (i % 8)) & 1) != (flags != 0)) ++bad;
+      if (checked[i] != expected) ++bad;
+      if (!flags && out[i] != expected) ++bad;
+    }
+    lequal(bad, 0);
+    tie_free(ex);
+  }
+}
+
+
+void test_specialize() {
+
+  int w1, w2, bias, x, y;
+  tie_variable lookup[] = {{"w1", &w1}, {"w2", &w2}, {"bias", &bias}, {"x", &x}, {"y", &y},
+                           {"sum2", sum2, TIE_FUNCTION2}};
+
+  int err;
+  tie_expression *ex = tie_compile("w1*x + w2*y + bias*3", lookup, 6, &err);
+  lok(ex);
+
+  w1 = 1;
+  w2 = 0;
+  bias = 4;
+  tie_expression *sp = tie_specialize(ex, lookup, 3);
+  lok(sp);
+
+  /* What is left is x + 12. */
+  const tie_expression *l = sp->parameters[0], *r = sp->parameters[1];
+  lequal(l->type, TIE_VARIABLE);
+  lok(l->bound == &x);
+  lequal(r->value, 12);
+
+  /* Later changes to the fixed variables only affect the original. */
+  w2 = 5;
+  for (x = -3; x < 3; ++x) {
+    y = x * 7;
+    lequal(tie_eval(sp), x + 12);
+    lequal(tie_eval(ex), x + 5 * y + 12);
+  }
+  tie_free(sp);
+  tie_free(ex);
+
+  /* Calls to functions that are not pure are kept, even when multiplied by zero. */
+  ex = tie_compile("w2*sum2(y, 1) + x", lookup, 6, &err);
+  w2 = 0;
+  sp = tie_specialize(ex, lookup, 2);
+  lok(((tie_expression *) sp->parameters[0])->type & TIE_FUNCTION0);
+  x = 2;
+  lequal(tie_eval(sp), 2);
+  tie_free(sp);
+  tie_free(ex);
+}
+
+
+void test_canonical() {
+
+  int a, b, c;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c}, {"sum2", sum2, TIE_FUNCTION2}};
+
+  const char *same[][2] = {
+      {"a+b",             "b + a"},
+      {"(a)",             "a"},
+      {"1+a+2",           "a+3"},
+      {"a*b*c",           "c*(b*a)"},
+      {"(a & b) | c",     "c | (b & a)"},
+      {"max(a, min(b, c))", "max(min(c, b), a)"},
+      {"2*a*3 + b",       "b + a*6"},
+      {"sum2(a, b) + c",  "c + sum2(a, b)"},
+  };
+
+  const char *different[][2] = {
+      {"a-b",             "b-a"},
+      {"a/b",             "b/a"},
+      {"sum2(a, b)",      "sum2(b, a)"},
+      {"a+b",             "a+c"},
+  };
+
+  int i, err;
+  for (i = 0; i < (int) (sizeof(same) / sizeof(same[0])); ++i) {
+    tie_expression *x = tie_canonicalize(tie_compile(same[i][0], lookup, 4, &err), lookup, 4);
+    tie_expression *y = tie_canonicalize(tie_compile(same[i][1], lookup, 4, &err), lookup, 4);
+    lok(x && y);
+    if (!x || !y) continue;
+    lok(tie_fingerprint(x, lookup, 4) == tie_fingerprint(y, lookup, 4));
+    for (a = -3; a < 3; ++a) {
+      b = a * 5 + 1;
+      c = 7 - a;
+      lequal(tie_eval(x), tie_eval(y));
+    }
+    tie_free(x);
+    tie_free(y);
+  }
+
+  for (i = 0; i < (int) (sizeof(different) / sizeof(different[0])); ++i) {
+    tie_expression *x = tie_canonicalize(tie_compile(different[i][0], lookup, 4, &err), lookup, 4);
+    tie_expression *y = tie_canonicalize(tie_compile(different[i][1], lookup, 4, &err), lookup, 4);
+    lok(tie_fingerprint(x, lookup, 4) != tie_fingerprint(y, lookup, 4));
+    tie_free(x);
+    tie_free(y);
+  }
+
+  /* Fingerprints do not depend on where the variables live. */
+  int a2, b2;
+  tie_variable moved[] = {{"a", &a2}, {"b", &b2}};
+  tie_expression *x = tie_compile("a*b+1", lookup, 2, &err);
+  tie_expression *y = tie_compile("a*b+1", moved, 2, &err);
+  lok(tie_fingerprint(x, lookup, 2) == tie_fingerprint(y, moved, 2));
+  tie_free(x);
+  tie_free(y);
+}
+
+
+void test_reduce() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+  enum { ROWS = 2500 };
+  static int xs[ROWS], ys[ROWS], out[ROWS];
+
+  int i;
+  for (i = 0; i < ROWS; ++i) {
+    xs[i] = i * 3 - ROWS;
+    ys[i] = (i * 11) % 17 - 8;
+  }
+  tie_column columns[] = {{&x, xs}, {&y, ys}, {0, 0}};
+
+  const char *exprs[] = {"x*y", "y", "x-y+1", "1", "0"};
+
+  int e;
+  for (e = 0; e < sizeof(exprs) / sizeof(const char *); ++e) {
+    int err;
+    tie_expression *ex = tie_compile(exprs[e], lookup, 2, &err);
+    lok(ex);
+    tie_eval_batch(ex, columns, ROWS, out);
+
+    long long sum = 0;
+    int low = out[0], high = out[0], count = 0;
+    for (i = 0; i < ROWS; ++i) {
+      sum += out[i];
+      if (out[i] < low) low = out[i];
+      if (out[i] > high) high = out[i];
+      count += out[i] != 0;
+    }
+
+    lok(tie_eval_reduce(ex, columns, ROWS, TIE_REDUCE_SUM) == sum);
+    lok(tie_eval_reduce(ex, columns, ROWS, TIE_REDUCE_MIN) == low);
+    lok(tie_eval_reduce(ex, columns, ROWS, TIE_REDUCE_MAX) == high);
+    lok(tie_eval_reduce(ex, columns, ROWS, TIE_REDUCE_COUNT) == count);
+    lok(tie_eval_reduce(ex, columns, ROWS, TIE_REDUCE_ANY) == (count > 0));
+    lok(tie_eval_reduce(ex, columns, ROWS, TIE_REDUCE_ALL) == (count == ROWS));
+    tie_free(ex);
+  }
+
+  /* Sums are not limited to int. */
+  static int big[ROWS];
+  for (i = 0; i < ROWS; ++i) big[i] = INT_MAX;
+  tie_column bigs[] = {{&x, big}, {0, 0}};
+  tie_expression *ex = tie_compile("x", lookup, 1, 0);
+  lok(tie_eval_reduce(ex, bigs, ROWS, TIE_REDUCE_SUM) == (long long) INT_MAX * ROWS);
+
+  /* Empty inputs give the identity of each reduction. */
+  lok(tie_eval_reduce(ex, bigs, 0, TIE_REDUCE_SUM) == 0);
+  lok(tie_eval_reduce(ex, bigs, 0, TIE_REDUCE_MIN) == INT_MAX);
+  lok(tie_eval_reduce(ex, bigs, 0, TIE_REDUCE_ALL) == 1);
+  lok(tie_eval_reduce(ex, bigs, ROWS, 99) == LLONG_MIN);
+  tie_free(ex);
+}
+
+
+void test_compare() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+  const char *exprs[] = {
+      "x<y", "x<=y", "x>y", "x>=y", "x==y", "x!=y",
+      "x+3<<2 < y", "x+1 == y-1", "x < y & y < 3", "if(x > y, x, y)", "max(x != 0, y >= 2)",
+  };
+
+  int e;
+  for (e = 0; e < sizeof(exprs) / sizeof(const char *); ++e) {
+    int err;
+    tie_expression *ex = tie_compile(exprs[e], lookup, 2, &err);
+    lok(ex);
+    if (!ex) continue;
+
+    for (x = -3; x <= 3; ++x) {
+      for (y = -3; y <= 3; ++y) {
+        int expected = 0;
+        switch (e) {
+          case 0: expected = x < y; break;
+          case 1: expected = x <= y; break;
+          case 2: expected = x > y; break;
+          case 3: expected = x >= y; break;
+          case 4: expected = x == y; break;
+          case 5: expected = x != y; break;
+          case 6: expected = (x + 3) * 4 < y; break;
+          case 7: expected = x + 1 == y - 1; break;
+          case 8: expected = (x < y) & (y < 3); break;
+          case 9: expected = x > y ? x : y; break;
+          case 10: expected = (x != 0) > (y >= 2) ? (x != 0) : (y >= 2); break;
+        }
+        lequal(tie_eval(ex), expected);
+      }
+    }
+    tie_free(ex);
+  }
+
+  /* Comparisons the declared ranges decide are folded to constants. */
+  tie_range small = {0, 9};
+  tie_variable ranged[] = {{"x", &x, TIE_VARIABLE, 0, 0, 0, 0, &small}, {"y", &y}};
+  tie_expression *ex = tie_compile("x < 10", ranged, 2, 0);
+  lok(!(ex->type & (TIE_FUNCTION0 | TIE_CLOSURE0)) && ex->type != TIE_VARIABLE);
+  lequal(ex->value, 1);
+  tie_free(ex);
+
+  ex = tie_compile("x == 12", ranged, 2, 0);
+  lok(!(ex->type & (TIE_FUNCTION0 | TIE_CLOSURE0)) && ex->type != TIE_VARIABLE);
+  lequal(ex->value, 0);
+  tie_free(ex);
+
+  ex = tie_compile("x < 5", ranged, 2, 0);
+  lok(ex->type & TIE_FUNCTION0);
+  tie_free(ex);
+}
+
+
+void test_predicate() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x}, {"y", &y}};
+
+  enum { ROWS = 3000 };
+  static int xs[ROWS], ys[ROWS], rows[ROWS], selected[ROWS];
+  static unsigned char bitmap[(ROWS + 7) / 8];
+
+  int i;
+  for (i = 0; i < ROWS; ++i) {
+    xs[i] = (i * 37) % 101;
+    ys[i] = i % 7;
+  }
+  tie_column columns[] = {{&x, xs}, {&y, ys}, {0, 0}};
+
+  int err;
+  tie_expression *a = tie_compile("x >= 50", lookup, 2, &err);
+  tie_expression *b = tie_compile("y == 3 | y == 5", lookup, 2, &err);
+  lok(a && b);
+
+  int expected = 0, bad = 0;
+  for (i = 0; i < ROWS; ++i) expected += xs[i] >= 50;
+  lequal(tie_eval_bitmap(a, columns, ROWS, bitmap), expected);
+  for (i = 0; i < ROWS; ++i) {
+    if (((bitmap[i / 8] >> (i % 8)) & 1) != (xs[i] >= 50)) ++bad;
+  }
+  lequal(bad, 0);
+
+  /* Chained filters: the second one only looks at rows the first one kept. */
+  const int first = tie_eval_select(a, columns, 0, ROWS, rows);
+  lequal(first, expected);
+  const int second = tie_eval_select(b, columns, rows, first, selected);
+
+  int k = 0;
+  bad = 0;
+  for (i = 0; i < ROWS; ++i) {
+    if (xs[i] >= 50 && (ys[i] == 3 || ys[i] == 5)) {
+      if (k >= second || selected[k] != i) ++bad;
+      ++k;
+    }
+  }
+  lequal(k, second);
+  lequal(bad, 0);
+
+  /* Filtering in place gives the same rows. */
+  lequal(tie_eval_select(b, columns, rows, first, rows), second);
+  lok(memcmp(rows, selected, second * sizeof(int)) == 0);
+
+  tie_free(a);
+  tie_free(b);
+}
+
+
+static int emitted(const tie_expression *n, const char *name, const tie_variable *vars, int count, char *buf, int size) {
+  FILE *f = tmpfile();
+  if (!f) return -1;
+  const int ret = tie_emit_c(n, name, vars, count, f);
+  rewind(f);
+  const size_t len = fread(buf, 1, size - 1, f);
+  buf[len] = '\0';
+  fclose(f);
+  return ret;
+}
+
+void test_emit() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x}, {"y", &y}, {"sum2", sum2, TIE_FUNCTION2}, {"cell", cell, TIE_CLOSURE1, &x}};
+
+  static char buf[8192];
+  int err;
+  tie_expression *ex = tie_compile("(x+1)*y - max(x, -2) + sum2(y, x < 3)", lookup, 4, &err);
+  lequal(emitted(ex, "rule", lookup, 4, buf, sizeof(buf)), 0);
+  lok(strstr(buf, "static inline int rule(const int *vars) {\n"
+                  "  return ((((vars[0] + 1) * vars[1]) - tie_max(vars[0], (-2))) + sum2(vars[1], (vars[0] < 3)));\n"));
+  lok(strstr(buf, "int sum2(int, int);\n"));
+  lok(strstr(buf, "static inline void rule_batch("));
+  lok(strstr(buf, "out[i] = ((((c0[i] + 1) * c1[i]) - tie_max(c0[i], (-2))) + sum2(c1[i], (c0[i] < 3)));"));
+  tie_free(ex);
+
+  /* Closures and unlisted variables cannot be emitted, and nothing is written for them. */
+  ex = tie_compile("sum2(y, cell x)", lookup, 4, &err);
+  lequal(emitted(ex, "rule", lookup, 4, buf, sizeof(buf)), -1);
+  lequal((int) strlen(buf), 0);
+  tie_free(ex);
+
+  ex = tie_compile("x + y", lookup, 2, &err);
+  lequal(emitted(ex, "rule", lookup, 1, buf, sizeof(buf)), -1);
+  lequal((int) strlen(buf), 0);
+  tie_free(ex);
+}
+
+
+static int weight_calls;
+
+int weight(int a) {
+  ++weight_calls;
+  return a * 3 + 1;
+}
+
+void test_hoist() {
+
+  int x, w, t;
+  tie_variable lookup[] = {{"x", &x}, {"w", &w}, {"t", &t},
+                           {"weight", weight, TIE_FUNCTION1 | TIE_FLAG_PURE},
+                           {"sum2", sum2, TIE_FUNCTION2}};
+
+  enum { ROWS = 2000 };
+  static int xs[ROWS], out[ROWS];
+
+  int i;
+  for (i = 0; i < ROWS; ++i) xs[i] = i % 97 - 40;
+  tie_column columns[] = {{&x, xs}, {0, 0}};
+
+  const char *exprs[] = {
+      "x * weight(w + t) - (w << 2)",
+      "max(x, t * 2) + 7 * x - (x > t)",
+      "sum2(w * t, x) + (w - t) / (x | 1)",
+      "if(w > t, x, -x) % 7",
+  };
+
+  int e;
+  for (e = 0; e < sizeof(exprs) / sizeof(const char *); ++e) {
+    int err;
+    tie_expression *ex = tie_compile(exprs[e], lookup, 5, &err);
+    lok(ex);
+    if (!ex) continue;
+
+    w = 5;
+    t = 3;
+    weight_calls = 0;
+    lequal(tie_eval_batch(ex, columns, ROWS, out), 0);
+    /* The pure call depends only on scalars, so it runs once for the whole batch. */
+    lok(weight_calls <= 1);
+
+    int bad = 0;
+    for (i = 0; i < ROWS; ++i) {
+      x = xs[i];
+      if (out[i] != tie_eval(ex)) ++bad;
+    }
+    lequal(bad, 0);
+
+    /* The scalars are read again on every call. */
+    w = 1;
+    tie_eval_batch(ex, columns, ROWS, out);
+    x = xs[5];
+    lequal(out[5], tie_eval(ex));
+
+    /* Small batches are not worth copying the tree for. */
+    tie_stats before, after;
+    tie_get_stats(&before);
+    lequal(tie_eval_batch(ex, columns, 100, out), 0);
+    tie_get_stats(&after);
+    lequal((int) (after.nodes_allocated - before.nodes_allocated), 0);
+    x = xs[99];
+    lequal(out[99], tie_eval(ex));
+    tie_free(ex);
+  }
+}
+
+
+void test_bulk() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x}, {"y", &y}, {"sum2", sum2, TIE_FUNCTION2}};
+
+  enum { COUNT = 1500 };
+  static char text[COUNT][64];
+  static const char *exprs[COUNT];
+  static tie_expression *out[COUNT];
+  static int errors[COUNT];
+
+  int i;
+  for (i = 0; i < COUNT; ++i) {
+    if (i % 100 == 7) snprintf(text[i], sizeof(text[i]), "x + (y * %d", i);
+    else snprintf(text[i], sizeof(text[i]), "sum2(x * %d, y) - (x < %d) + y %% %d", i, i % 50, i % 9 + 1);
+    exprs[i] = text[i];
+  }
+
+  int threads[] = {1, 4, 0};
+  int t;
+  for (t = 0; t < 3; ++t) {
+    lequal(tie_compile_bulk(exprs, COUNT, lookup, 3, threads[t], out, errors), COUNT / 100);
+
+    int bad = 0;
+    x = 13;
+    y = -4;
+    for (i = 0; i < COUNT; ++i) {
+      int err;
+      tie_expression *ex = tie_compile(exprs[i], lookup, 3, &err);
+      if (err != errors[i] || !ex != !out[i]) ++bad;
+      if (ex && out[i] && tie_eval(ex) != tie_eval(out[i])) ++bad;
+      tie_free(ex);
+      tie_free(out[i]);
+    }
+    lequal(bad, 0);
+  }
+}
+
+
+void test_interp_buf() {
+
+  const char *exprs[] = {"1+2*3", "abs(-5) << 2", "(4 > 3) + max(2, 9) % 5", "if(0, 1, 7)", "10/3 - -2", "1+", "foo(2)"};
+
+  void *scratch[64];
+  int i;
+  for (i = 0; i < sizeof(exprs) / sizeof(const char *); ++i) {
+    int err1, err2;
+    const int a = tie_interp(exprs[i], &err1);
+    const int b = tie_interp_buf(exprs[i], scratch, sizeof(scratch), &err2);
+    lequal(err1, err2);
+    if (!err1) lequal(a, b);
+  }
+
+  /* Too little scratch is reported rather than overrun. */
+  int err;
+  tie_interp_buf("1+2+3+4+5+6+7+8", scratch, 32, &err);
+  lequal(err, -1);
+  tie_interp_buf("1+2", (char *) scratch + 1, 3, &err);
+  lequal(err, -1);
+
+  /* Scratch need not be aligned. */
+  lequal(tie_interp_buf("(4 > 3) + max(2, 9) % 5", (char *) scratch + 1, sizeof(scratch) - 1, &err), 5);
+  lequal(err, 0);
+
+  /* tie_interp still handles expressions too big for its stack buffer. */
+  static char big[4000];
+  for (i = 0; i < 1000; ++i) memcpy(big + i * 2, "1+", 2);
+  big[2000] = '1';
+  big[2001] = '\0';
+  lequal(tie_interp(big, &err), 1001);
+  lequal(err, 0);
+}
+
+
+static int handle_stop;
+
+static void *handle_reader(void *arg) {
+  tie_handle *h = arg;
+  int bad = 0;
+  while (!__atomic_load_n(&handle_stop, __ATOMIC_RELAXED)) {
+    unsigned token;
+    const tie_expression *n = tie_handle_enter(h, &token);
+    const int a = tie_eval(n), b = tie_eval(n);
+    /* Every version evaluates to a multiple of 1001, and does not change under us. */
+    if (a != b || a % 1001) ++bad;
+    tie_handle_leave(h, token);
+    if (tie_handle_eval(h) % 1001) ++bad;
+  }
+  return (void *) (long) bad;
+}
+
+void test_handle() {
+
+  tie_handle *h = tie_handle_new(tie_compile("0", 0, 0, 0));
+  lok(h);
+  lequal((int) ((size_t) h % 64), 0);
+  lequal(tie_handle_eval(h), 0);
+
+  pthread_t threads[4];
+  int i;
+  handle_stop = 0;
+  for (i = 0; i < 4; ++i) pthread_create(&threads[i], 0, handle_reader, h);
+
+  for (i = 1; i <= 300; ++i) {
+    char text[64];
+    snprintf(text, sizeof(text), "(%d * 1000 + %d) * (1 + 0 * %d)", i, i, i);
+    tie_handle_publish(h, tie_compile(text, 0, 0, 0));
+  }
+  __atomic_store_n(&handle_stop, 1, __ATOMIC_RELAXED);
+
+  int bad = 0;
+  for (i = 0; i < 4; ++i) {
+    void *ret;
+    pthread_join(threads[i], &ret);
+    bad += (int) (long) ret;
+  }
+  lequal(bad, 0);
+  lequal(tie_handle_eval(h), 300 * 1001);
+
+  tie_handle_publish(h, 0);
+  lequal(tie_handle_eval(h), 0);
+  tie_handle_free(h);
+}
+
+
+void test_limits() {
+
+  int x;
+  tie_variable lookup[] = {{"x", &x}, {"sum2", sum2, TIE_FUNCTION2, 0, 0, 50}};
+
+  tie_limits limits = {20, 4, 12};
+  int err;
+
+  tie_expression *ex = tie_compile_limited("x*2 + sum2(x, 3)", lookup, 2, &limits, &err);
+  lok(ex);
+  lequal(err, 0);
+  /* Seven nodes, one of them a call that costs 50. */
+  lequal((int) tie_cost(ex, lookup, 2), 56);
+  lequal((int) tie_cost(ex, lookup, 1), 7);
+  tie_free(ex);
+
+  /* Too many tokens. */
+  tie_limits few_tokens = {20, 0, 0};
+  ex = tie_compile_limited("x+x+x+x+x+x+x+x+x+x+x+x", lookup, 2, &few_tokens, &err);
+  lok(!ex);
+  lequal(err, 20);
+
+  /* Nested too deeply. */
+  ex = tie_compile_limited("((((x))))", lookup, 2, &limits, &err);
+  lok(!ex);
+  lok(err > 0);
+  ex = tie_compile_limited("(((x)))", lookup, 2, &limits, &err);
+  lok(ex);
+  tie_free(ex);
+
+  /* Too many nodes, even though few tokens. */
+  limits.max_tokens = 0;
+  ex = tie_compile_limited("x*x*x*x*x*x*x", lookup, 2, &limits, &err);
+  lok(!ex);
+  lok(err > 0);
+
+  /* No limits at all. */
+  ex = tie_compile_limited("((((x*x*x*x*x*x*x))))", lookup, 2, 0, &err);
+  lok(ex);
+  tie_free(ex);
+}
+
+
+static int tier_calls;
+static int tier(int a) {
+  __atomic_fetch_add(&tier_calls, 1, __ATOMIC_RELAXED);
+  return a / 100;
+}
+
+static __thread int memo_step;
+static int step(void) {
+  return memo_step;
+}
+
+static void *memo_worker(void *arg) {
+  const tie_expression *n = arg;
+  int bad = 0, i;
+  for (i = 0; i < 20000; ++i) {
+    memo_step = (i * 7 + i / 3) % 1000;
+    if (tie_eval(n) != memo_step / 100 * 2) ++bad;
+  }
+  return (void *) (long) bad;
+}
+
+void test_memo() {
+
+  int x, y;
+  tie_variable lookup[] = {{"x", &x}, {"y", &y},
+                           {"tier", tier, TIE_FUNCTION1 | TIE_FLAG_PURE | TIE_FLAG_MEMO},
+                           {"sum2", sum2, TIE_FUNCTION2 | TIE_FLAG_MEMO}};
+  tie_memo_stats stats;
+  int err, i;
+
+  tie_expression *n = tie_compile("tier(x) + sum2(x, y)", lookup, 4, &err);
+  lok(n);
+  tier_calls = 0;
+  for (i = 0; i < 1000; ++i) {
+    x = (i % 10) * 100 + 5;
+    y = i % 3;
+    lequal(tie_eval(n), x / 100 + x + y);
+  }
+  /* Ten distinct arguments for tier. The thirty of sum2 may collide in the memo. */
+  lequal(tier_calls, 10);
+  tie_memo_get_stats(n, &stats);
+  lequal((int) (stats.hits + stats.misses), 2000);
+  lok(stats.misses >= 40 && stats.misses < 500);
+
+  /* Batches go through the memo too. */
+  int xs[8] = {5, 105, 5, 105, 5, 105, 5, 1005}, out[8];
+  tie_column columns[] = {{&x, xs}, {0, 0}};
+  y = 0;
+  lequal(tie_eval_batch(n, columns, 8, out), 0);
+  for (i = 0; i < 8; ++i) lequal(out[i], xs[i] / 100 + xs[i]);
+  lequal(tier_calls, 11);
+
+  /* Copies share the memo, and keep it after the original is freed. */
+  tie_expression *copy = tie_specialize(n, lookup + 1, 1);
+  tie_free(n);
+  x = 1105;
+  lequal(tie_eval(copy), 11 + 1105);
+  lequal(tier_calls, 12);
+  tie_free(copy);
+
+  /* Constant arguments of pure functions are still folded. */
+  n = tie_compile("tier(250)", lookup, 4, &err);
+  lequal((int) tie_cost(n, lookup, 4), 1);
+  lequal(tie_eval(n), 2);
+  tie_free(n);
+
+  /* No memo without arguments to key on or without a heap. */
+  char scratch[4096];
+  lequal(tie_interp_buf("1 + 2", scratch, sizeof(scratch), &err), 3);
+
+  /* Threads sharing one memo, each with its own arguments. */
+  n = tie_compile("tier(step) + tier(step + 0)", (tie_variable[]) {{"step", step, TIE_FUNCTION0}, lookup[2]}, 2, &err);
+  lok(n);
+  pthread_t threads[4];
+  int bad = 0;
+  for (i = 0; i < 4; ++i) pthread_create(&threads[i], 0, memo_worker, n);
+  for (i = 0; i < 4; ++i) {
+    void *ret;
+    pthread_join(threads[i], &ret);
+    bad += (int) (long) ret;
+  }
+  lequal(bad, 0);
+  tie_memo_get_stats(n, &stats);
+  lequal((int) (stats.hits + stats.misses), 2 * 4 * 20000);
+  tie_free(n);
+}
+
+
+static int nested(void *context) {
+  return tie_eval(context);
+}
+
+void test_let() {
+
+  int a, b, c, lo = 0, hi = 0;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c},
+                           {"lo", &lo, TIE_VARIABLE | TIE_FLAG_OUTPUT}, {"hi", &hi, TIE_VARIABLE | TIE_FLAG_OUTPUT}};
+  int err, i;
+
+  tie_expression *n = tie_compile("t = a*b + c, t ^ (t >> 4)", lookup, 3, &err);
+  lok(n);
+  a = 37; b = 11; c = 5;
+  lequal(tie_eval(n), (37 * 11 + 5) ^ ((37 * 11 + 5) >> 4));
+
+  /* Every row of a batch gets its own value; c has no column and is hoisted. */
+  int as[2000], bs[2000], out[2000];
+  tie_column columns[] = {{&a, as}, {&b, bs}, {0, 0}};
+  for (i = 0; i < 2000; ++i) {
+    as[i] = i * 3 - 1000;
+    bs[i] = i % 17;
+  }
+  lequal(tie_eval_batch(n, columns, 2000, out), 0);
+  int bad = 0;
+  for (i = 0; i < 2000; ++i) {
+    const int t = as[i] * bs[i] + c;
+    bad += out[i] != (t ^ (t >> 4));
+  }
+  lequal(bad, 0);
+  tie_free(n);
+
+  /* Several outputs from one pass. */
+  n = tie_compile("lo = a & 255, hi = a >> 8, lo + hi", lookup, 5, &err);
+  lok(n);
+  a = 0x1234;
+  lequal(tie_eval(n), 0x34 + 0x12);
+  lequal(lo, 0x34);
+  lequal(hi, 0x12);
+  lequal(tie_eval_checked(n, &err), 0x34 + 0x12);
+  lequal(err, 0);
+  tie_free(n);
+
+  /* A list that ends with an assignment has its value. */
+  n = tie_compile("lo = a * 2", lookup, 5, &err);
+  a = 21;
+  lequal(tie_eval(n), 42);
+  lequal(lo, 42);
+  tie_free(n);
+
+  lequal(tie_interp("t = 3, t * t", 0), 9);
+  lequal(tie_interp("t = 1, t = t + 10, t * 2", 0), 22);
+  lequal(tie_interp("(t = 2, t + 1) * 5", 0), 15);
+  lequal(tie_interp("1, t = 4, 2, t", 0), 4);
+
+  /* Names are only bound for the rest of their list, and only new names and outputs can be assigned. */
+  const char *bad_lets[] = {"(t = 2, t) + t", "t + 1, t = 2", "t = t + 1", "a = 1", "abs = 1", "1 + t = 2",
+                            "sum2(t = 1, 2)", "t = "};
+  for (i = 0; i < (int) (sizeof(bad_lets) / sizeof(bad_lets[0])); ++i) {
+    n = tie_compile(bad_lets[i], lookup, 5, &err);
+    lok(!n);
+    lok(err != 0);
+  }
+
+  /* Too many names. */
+  char text[1024] = "";
+  for (i = 0; i < 65; ++i) snprintf(text + strlen(text), sizeof(text) - strlen(text), "t%d = %d, ", i, i);
+  strcat(text, "t0");
+  lok(!tie_compile(text, lookup, 5, &err));
+
+  /* Names in different bindings are told apart. */
+  tie_expression *sum = tie_compile("t = a, u = b, t + u", lookup, 3, 0);
+  tie_expression *twice = tie_compile("t = a, u = b, t + t", lookup, 3, 0);
+  lok(tie_fingerprint(sum, lookup, 3) != tie_fingerprint(twice, lookup, 3));
+  tie_free(sum);
+  tie_free(twice);
+
+  /* An expression evaluated from inside another keeps its bindings apart. */
+  tie_expression *inner = tie_compile("u = 5, u * 2", 0, 0, 0);
+  tie_variable outer_lookup[] = {{"inner", nested, TIE_CLOSURE0, inner}};
+  n = tie_compile("t = 7, inner + t", outer_lookup, 1, &err);
+  lok(n);
+  lequal(tie_eval(n), 17);
+  tie_free(n);
+  tie_free(inner);
+}
+
+
+typedef struct reading {
+  signed char delta;
+  unsigned char flags;
+  short level;
+  unsigned id;
+  long long total;
+  int plain;
+} reading;
+
+void test_records() {
+
+  int delta, flags, level, id, total, plain, k = 3;
+  tie_range small = {-128, 127};
+  tie_variable lookup[] = {{"delta", &delta, TIE_VARIABLE, 0, 0, 0, 0, &small}, {"flags", &flags}, {"level", &level},
+                           {"id", &id}, {"total", &total}, {"plain", &plain}, {"k", &k}};
+  tie_field fields[] = {
+      {&delta, offsetof(reading, delta), TIE_INT8},
+      {&flags, offsetof(reading, flags), TIE_UINT8},
+      {&level, offsetof(reading, level), TIE_INT16},
+      {&id, offsetof(reading, id), TIE_UINT32},
+      {&total, offsetof(reading, total), TIE_INT64},
+      {&plain, offsetof(reading, plain), TIE_INT32},
+      {0, 0, 0}};
+
+  static reading records[3000];
+  static int out[3000];
+  int i, bad = 0;
+  for (i = 0; i < 3000; ++i) {
+    records[i].delta = (signed char) (i * 7);
+    records[i].flags = (unsigned char) (i * 13);
+    records[i].level = (short) (i * 1001);
+    records[i].id = 0xfffff000u + i;
+    records[i].total = 0x100000000LL * i + i;
+    records[i].plain = i - 1500;
+  }
+
+  const char *exprs[] = {"delta + flags * k", "level ^ id", "total + plain", "(delta + 1) * 2 < 0"};
+  int e;
+  for (e = 0; e < 4; ++e) {
+    tie_expression *n = tie_compile(exprs[e], lookup, 7, 0);
+    lok(n);
+    lequal(tie_eval_records(n, records, sizeof(reading), fields, 3000, out), 0);
+    for (i = 0; i < 3000; ++i) {
+      delta = records[i].delta;
+      flags = records[i].flags;
+      level = records[i].level;
+      id = (int) records[i].id;
+      total = (int) records[i].total;
+      plain = records[i].plain;
+      bad += out[i] != tie_eval(n);
+    }
+    tie_free(n);
+  }
+  lequal(bad, 0);
+}
+
+
+void test_storage() {
+
+  signed char s8 = -100;
+  unsigned char u8 = 200;
+  short s16 = -30000;
+  unsigned short u16 = 60000;
+  unsigned u32 = 0xfffffff0u;
+  long long s64 = 0x100000005LL;
+  int out = 0;
+  tie_variable lookup[] = {
+      {"s8", &s8, TIE_VARIABLE, 0, 0, 0, TIE_INT8},
+      {"u8", &u8, TIE_VARIABLE, 0, 0, 0, TIE_UINT8},
+      {"s16", &s16, TIE_VARIABLE, 0, 0, 0, TIE_INT16},
+      {"u16", &u16, TIE_VARIABLE, 0, 0, 0, TIE_UINT16},
+      {"u32", &u32, TIE_VARIABLE, 0, 0, 0, TIE_UINT32},
+      {"s64", &s64, TIE_VARIABLE, 0, 0, 0, TIE_INT64},
+      {"out", &out, TIE_VARIABLE | TIE_FLAG_OUTPUT},
+      {"wide", &s64, TIE_VARIABLE | TIE_FLAG_OUTPUT, 0, 0, 0, TIE_INT64}};
+  int err, i;
+
+  tie_expression *n = tie_compile("s8 + u8 + s16 + u16 + u32 + s64", lookup, 8, &err);
+  lok(n);
+  lequal(tie_eval(n), -100 + 200 - 30000 + 60000 - 16 + 5);
+  lequal(tie_eval_checked(n, &err), -100 + 200 - 30000 + 60000 - 16 + 5);
+  tie_free(n);
+
+  /* The type gives the range: u8 can never be negative. */
+  n = tie_compile("u8 >= 0", lookup, 8, &err);
+  lequal((int) tie_cost(n, 0, 0), 1);
+  tie_free(n);
+  lequal(tie_get_range(n = tie_compile("s8 * 2 + u8", lookup, 8, 0)).max, 127 * 2 + 255);
+  tie_free(n);
+
+  /* Columns hold the variable's type, in the wide and the 16-bit evaluators. */
+  static unsigned char flags[3000];
+  static short levels[3000];
+  static long long totals[3000];
+  static int results[3000];
+  for (i = 0; i < 3000; ++i) {
+    flags[i] = (unsigned char) (i * 7);
+    levels[i] = (short) (i * 21 - 30000);
+    totals[i] = 0x100000000LL * i + i;
+  }
+  tie_column columns[] = {{&u8, flags}, {&s16, levels}, {&s64, totals}, {0, 0}};
+  const char *exprs[] = {"u8 * 3 - s16", "s64 ^ u8", "(u8 & 15) + s8", "u8 < 100"};
+  int bad = 0;
+  for (int e = 0; e < 4; ++e) {
+    n = tie_compile(exprs[e], lookup, 8, 0);
+    lequal(tie_eval_batch(n, columns, 3000, results), 0);
+    for (i = 0; i < 3000; ++i) {
+      u8 = flags[i];
+      s16 = levels[i];
+      s64 = totals[i];
+      bad += results[i] != tie_eval(n);
+    }
+    tie_free(n);
+  }
+  lequal(bad, 0);
+
+  /* Specializing reads the typed value. */
+  u8 = 250;
+  n = tie_compile("u8 + 1", lookup, 8, 0);
+  tie_expression *fixed = tie_specialize(n, lookup + 1, 1);
+  lequal(tie_eval(fixed), 251);
+  tie_free(fixed);
+  tie_free(n);
+
+  /* Outputs are ints. */
+  n = tie_compile("out = u8", lookup, 8, &err);
+  lequal(tie_eval(n), 250);
+  lequal(out, 250);
+  tie_free(n);
+  lok(!tie_compile("wide = u8", lookup, 8, &err));
+}
+
+
+static int running, most_running;
+static int slow(void *context, int a) {
+  /* Sleeps long enough for the calls of one evaluation to overlap. */
+  const int now = __atomic_add_fetch(&running, 1, __ATOMIC_RELAXED);
+  int most = __atomic_load_n(&most_running, __ATOMIC_RELAXED);
+  while (now > most && !__atomic_compare_exchange_n(&most_running, &most, now, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {}
+  usleep(20000);
+  __atomic_sub_fetch(&running, 1, __ATOMIC_RELAXED);
+  return a * (int) (long) context;
+}
+
+static void *parallel_worker(void *arg) {
+  void **p = arg;
+  return (void *) (long) tie_eval_parallel(p[0], p[1]);
+}
+
+void test_parallel() {
+
+  int a = 3, b = 5, c = 7;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c},
+                           {"f", slow, TIE_CLOSURE1, (void *) 2, 0, 1000},
+                           {"g", slow, TIE_CLOSURE1, (void *) 10, 0, 1000}};
+  tie_pool *pool = tie_pool_new(3);
+  int err, i;
+  lok(pool);
+
+  tie_expression *n = tie_compile("f(a) + g(b) + f(c) * 2", lookup, 5, &err);
+  lequal(tie_parallelize(n, lookup, 5, 100), 3);
+  most_running = 0;
+  lequal(tie_eval_parallel(n, pool), 6 + 50 + 28);
+  lok(most_running >= 2);
+  lequal(tie_eval(n), 6 + 50 + 28);
+  lequal(tie_eval_parallel(n, 0), 6 + 50 + 28);
+  tie_free(n);
+  lequal(tie_eval_parallel(0, pool), 0);
+
+  /* The arguments of an expensive call run concurrently, then the call itself. */
+  n = tie_compile("g(f(a) - f(b + 1))", lookup, 5, &err);
+  lequal(tie_parallelize(n, lookup, 5, 100), 2);
+  lequal(tie_eval_parallel(n, pool), (6 - 12) * 10);
+  tie_free(n);
+
+  /* One expensive call is not split off, and neither is a subtree reading a binding. */
+  n = tie_compile("f(a) + a*b", lookup, 5, &err);
+  lequal(tie_parallelize(n, lookup, 5, 100), 0);
+  lequal(tie_eval_parallel(n, pool), 6 + 15);
+  tie_free(n);
+
+  n = tie_compile("t = f(a), g(t) + g(b) + t", lookup, 5, &err);
+  lok(n);
+  lequal(tie_parallelize(n, lookup, 5, 100), 2);
+  lequal(tie_eval_parallel(n, pool), 60 + 50 + 6);
+  tie_free(n);
+
+  /* Callers sharing the pool. */
+  n = tie_compile("f(a) + f(b) + g(c)", lookup, 5, &err);
+  lequal(tie_parallelize(n, lookup, 5, 100), 3);
+  pthread_t threads[4];
+  void *args[] = {n, pool};
+  for (i = 0; i < 4; ++i) pthread_create(&threads[i], 0, parallel_worker, args);
+  for (i = 0; i < 4; ++i) {
+    void *ret;
+    pthread_join(threads[i], &ret);
+    lequal((int) (long) ret, 6 + 10 + 70);
+  }
+  tie_free(n);
+  tie_pool_free(pool);
+}
+
+
+static void *stats_worker(void *arg) {
+  tie_expression *n = tie_compile("x * 3", arg, 1, 0);
+  int i;
+  for (i = 0; i < 100; ++i) tie_eval(n);
+  tie_free(n);
+  return 0;
+}
+
+void test_stats() {
+
+  int a = 4, b = 5;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}};
+  tie_stats before, after;
+  int err, i;
+
+  tie_get_stats(&before);
+  tie_expression *n = tie_compile("a + b*2 + 3*4", lookup, 2, &err);
+  lok(!tie_compile("a +", lookup, 2, &err));
+  tie_get_stats(&after);
+  lequal((int) (after.compiles - before.compiles), 2);
+  lequal((int) (after.compile_failures - before.compile_failures), 1);
+  lequal((int) (after.folded_nodes - before.folded_nodes), 1);
+  lok(after.nodes_allocated - before.nodes_allocated >= 7);
+  lok(after.bytes_live > before.bytes_live);
+
+  /* Seven nodes, since 3*4 was folded. */
+  for (i = 0; i < 10; ++i) tie_eval(n);
+  int as[100], out[100];
+  tie_column columns[] = {{&a, as}, {0, 0}};
+  for (i = 0; i < 100; ++i) as[i] = i;
+  lequal(tie_eval_batch(n, columns, 100, out), 0);
+  tie_get_stats(&before);
+  lequal((int) (before.evaluations - after.evaluations), 110);
+  lok(before.nodes_evaluated - after.nodes_evaluated >= 70);
+  lok(before.nodes_per_evaluation >= 1);
+
+  /* Evaluations whose nodes are not counted leave the average alone. */
+  for (i = 0; i < 100000; ++i) tie_eval(n);
+  tie_get_stats(&after);
+  lok(after.nodes_per_evaluation >= 1);
+#ifndef TIE_NODE_STATS
+  lok(after.nodes_per_evaluation == before.nodes_per_evaluation);
+#endif
+
+  tie_free(n);
+  tie_get_stats(&after);
+  lok(after.bytes_live < before.bytes_live);
+
+  /* Counts of threads that have ended are kept. */
+  pthread_t thread;
+  pthread_create(&thread, 0, stats_worker, (tie_variable[]) {{"x", &a}});
+  pthread_join(thread, 0);
+  tie_get_stats(&before);
+  lequal((int) (before.compiles - after.compiles), 1);
+  lequal((int) (before.evaluations - after.evaluations), 100);
+#ifdef TIE_NODE_STATS
+  lequal((int) (before.nodes_evaluated - after.nodes_evaluated), 300);
+#else
+  lequal((int) (before.nodes_evaluated - after.nodes_evaluated), 0);
+#endif
+  lequal((int) (before.bytes_live - after.bytes_live), 0);
+
+  tie_cache *cache = tie_cache_new(lookup, 2, 4);
+  tie_cache_release(tie_cache_acquire(cache, "a + b", &err));
+  tie_cache_release(tie_cache_acquire(cache, "a+b", &err));
+  tie_cache_free(cache);
+  tie_get_stats(&after);
+  lequal((int) (after.cache_misses - before.cache_misses), 1);
+  lequal((int) (after.cache_hits - before.cache_hits), 1);
+}
+
+
+static const int *topk_scores;
+static int compare_scores(const void *a, const void *b) {
+  /* Highest score first, then lowest row. */
+  const int x = *(const int *) a, y = *(const int *) b;
+  if (topk_scores[x] != topk_scores[y]) return topk_scores[x] < topk_scores[y] ? 1 : -1;
+  return x - y;
+}
+
+void test_topk() {
+
+  int a, b, c = 3;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c}};
+  enum { ROWS = 5000 };
+  static int as[ROWS], bs[ROWS], scores[ROWS], order[ROWS];
+  int idx[ROWS + 1], val[ROWS + 1];
+  tie_column columns[] = {{&a, as}, {&b, bs}, {0, 0}};
+  int err, i, t;
+
+  for (i = 0; i < ROWS; ++i) {
+    as[i] = (i * 7919) % 1009 - 500;
+    bs[i] = i % 13;
+  }
+
+  /* c has no column, so it is hoisted. (a*c) % 50 gives many equal scores. */
+  const char *expressions[] = {"a*c + b", "(a*c) % 50", "-a"};
+  for (t = 0; t < 3; ++t) {
+    tie_expression *n = tie_compile(expressions[t], lookup, 3, &err);
+    lok(n);
+    lequal(tie_eval_batch(n, columns, ROWS, scores), 0);
+    for (i = 0; i < ROWS; ++i) order[i] = i;
+    topk_scores = scores;
+    qsort(order, ROWS, sizeof(int), compare_scores);
+
+    const int ks[] = {1, 10, 100, 1500, ROWS};
+    int j;
+    for (j = 0; j < 5; ++j) {
+      lequal(tie_eval_topk(n, columns, ROWS, ks[j], idx, val), ks[j]);
+      int bad = 0;
+      for (i = 0; i < ks[j]; ++i) bad += idx[i] != order[i] || val[i] != scores[order[i]];
+      lequal(bad, 0);
+    }
+    tie_free(n);
+  }
+
+  tie_expression *n = tie_compile("a", lookup, 3, &err);
+  lequal(tie_eval_topk(n, columns, 3, 10, idx, val), 3);
+  lequal(idx[0], 1);
+  lequal(tie_eval_topk(n, columns, ROWS, 0, idx, val), 0);
+  lequal(tie_eval_topk(n, columns, ROWS, -1, idx, val), -1);
+  lequal(tie_eval_topk(0, columns, ROWS, 5, idx, val), -1);
+  tie_free(n);
+}
+
+
+void test_group() {
+
+  int a, b, c = 37;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}, {"c", &c}};
+  enum { ROWS = 100000, KEYS = 37 };
+  static int as[ROWS], bs[ROWS];
+  tie_column columns[] = {{&a, as}, {&b, bs}, {0, 0}};
+  tie_group *groups;
+  int err, i, op, t;
+
+  for (i = 0; i < ROWS; ++i) {
+    as[i] = i * 31 + (i >> 5);
+    bs[i] = (i * 7919) % 201 - 100;
+  }
+
+  /* Keys from -18 to 18; c has no column and is hoisted. */
+  tie_expression *key = tie_compile("a % c - 18", lookup, 3, &err);
+  tie_expression *value = tie_compile("b * 3", lookup, 3, &err);
+  lok(key && value);
+
+  for (op = TIE_REDUCE_SUM; op <= TIE_REDUCE_ALL; ++op) {
+    long long expect[KEYS];
+    int rows[KEYS];
+    for (i = 0; i < KEYS; ++i) {
+      expect[i] = op == TIE_REDUCE_MIN ? LLONG_MAX : op == TIE_REDUCE_MAX ? LLONG_MIN : 0;
+      rows[i] = 0;
+    }
+    for (i = 0; i < ROWS; ++i) {
+      const int k = as[i] % 37, v = bs[i] * 3;
+      ++rows[k];
+      if (op == TIE_REDUCE_SUM) expect[k] += v;
+      else if (op == TIE_REDUCE_MIN) expect[k] = v < expect[k] ? v : expect[k];
+      else if (op == TIE_REDUCE_MAX) expect[k] = v > expect[k] ? v : expect[k];
+      else expect[k] += v != 0;
+    }
+
+    for (t = 1; t <= 4; t += 3) {
+      lequal(tie_group_aggregate(key, value, columns, ROWS, op, t, &groups), KEYS);
+      int bad = 0;
+      for (i = 0; i < KEYS; ++i) {
+        long long e = expect[i];
+        if (op == TIE_REDUCE_ANY) e = e != 0;
+        if (op == TIE_REDUCE_ALL) e = e == rows[i];
+        bad += groups[i].key != i - 18 || groups[i].rows != rows[i] || groups[i].value != e;
+      }
+      lequal(bad, 0);
+      free(groups);
+    }
+  }
+
+  /* Counting rows needs no value expression; the other reductions do. */
+  lequal(tie_group_aggregate(key, 0, columns, 1000, TIE_REDUCE_COUNT, 0, &groups), KEYS);
+  int total = 0;
+  for (i = 0; i < KEYS; ++i) total += groups[i].value;
+  lequal(total, 1000);
+  free(groups);
+  lequal(tie_group_aggregate(key, 0, columns, 1000, TIE_REDUCE_SUM, 0, &groups), -1);
+  lequal(tie_group_aggregate(key, value, columns, 0, TIE_REDUCE_SUM, 0, &groups), 0);
+  free(groups);
+
+  /* Many distinct keys make the tables grow. */
+  tie_free(key);
+  key = tie_compile("a", lookup, 3, &err);
+  lequal(tie_group_aggregate(key, value, columns, ROWS, TIE_REDUCE_SUM, 4, &groups), ROWS);
+  int sorted = 1;
+  for (i = 1; i < ROWS; ++i) sorted &= groups[i - 1].key < groups[i].key && groups[i].rows == 1;
+  lok(sorted);
+  free(groups);
+
+  tie_free(key);
+  tie_free(value);
+}
+
+
+void test_sweep() {
+
+  int a = 0, b = 7;
+  unsigned char u8 = 3;
+  tie_variable lookup[] = {{"a", &a}, {"b", &b}, {"u8", &u8, TIE_VARIABLE, 0, 0, 0, TIE_UINT8}};
+  enum { ROWS = 3000 };
+  static int as[ROWS], expect[ROWS], out[ROWS];
+  tie_column columns[] = {{&a, as}, {0, 0}};
+  int err, i, t;
+
+  /* Small values, so that nothing overflows in either evaluator. */
+  const struct {
+    const char *expr;
+    int degree;
+    int start, step, rows;
+  } cases[] = {
+      {"a*3 + b", 1, -37, 1, ROWS},
+      {"-(a - 5) * b", 1, 100, 3, ROWS},
+      {"a*a - 2*a*b + 1", 2, -1000, 1, ROWS},
+      {"(a + 1) * (a - 2) * (a + b) / 1", 3, -37, 1, 1037},
+      {"b * b + max(b, 3)", 0, 0, 1, ROWS},
+      {"a*a*a*a*a*a*a*a*a", -1, -9, 1, 19},
+      {"a / 3 + a", -1, -37, 3, ROWS},
+      {"abs(a) * 2", -1, -37, 1, ROWS},
+      {"t = a * 2, t * t", -1, -37, 1, ROWS},
+  };
+
+  for (t = 0; t < (int) (sizeof(cases) / sizeof(cases[0])); ++t) {
+    const int start = cases[t].start, step = cases[t].step, rows = cases[t].rows;
+    tie_expression *n = tie_compile(cases[t].expr, lookup, 3, &err);
+    lok(n);
+    lequal(tie_poly_degree(n, &a), cases[t].degree);
+
+    for (i = 0; i < rows; ++i) as[i] = start + i * step;
+    lequal(tie_eval_batch(n, columns, rows, expect), 0);
+    lequal(tie_eval_sweep(n, &a, start, step, rows, out), 0);
+    lequal(memcmp(out, expect, sizeof(int) * rows), 0);
+
+    /* Fewer rows than the differences need. */
+    lequal(tie_eval_sweep(n, &a, start, step, 2, out), 0);
+    lequal(memcmp(out, expect, sizeof(int) * 2), 0);
+    tie_free(n);
+  }
+
+  /* A negative step, over several blocks. */
+  tie_expression *n = tie_compile("a * 5 - b", lookup, 3, &err);
+  lequal(tie_eval_sweep(n, &a, 1000, -2, ROWS, out), 0);
+  int bad = 0;
+  for (i = 0; i < ROWS; ++i) bad += out[i] != (1000 - 2 * i) * 5 - 7;
+  lequal(bad, 0);
+  tie_free(n);
+
+  /* Sweeps are over int variables. */
+  n = tie_compile("u8 + 1", lookup, 3, &err);
+  lequal(tie_poly_degree(n, (const int *) &u8), -1);
+  lequal(tie_eval_sweep(n, (const int *) &u8, 0, 1, 10, out), -1);
+  tie_free(n);
+}
+
+
 int main(int argc, char *argv[]) {
   lrun("Results", test_results);
   lrun("Syntax", test_syntax);
@@ -492,6 +2107,32 @@ int main(int argc, char *argv[]) {
   lrun("Dynamic", test_dynamic);
   lrun("Closure", test_closure);
   lrun("Optimize", test_optimize);
+  lrun("Checked", test_checked);
+  lrun("Batch", test_batch);
+  lrun("Batch funcs", test_batch_functions);
+  lrun("Intrinsics", test_intrinsics);
+  lrun("Cache", test_cache);
+  lrun("Ranges", test_ranges);
+  lrun("Specialize", test_specialize);
+  lrun("Canonical", test_canonical);
+  lrun("Reduce", test_reduce);
+  lrun("Compare", test_compare);
+  lrun("Predicate", test_predicate);
+  lrun("Emit", test_emit);
+  lrun("Hoist", test_hoist);
+  lrun("Bulk", test_bulk);
+  lrun("Interp buf", test_interp_buf);
+  lrun("Handle", test_handle);
+  lrun("Limits", test_limits);
+  lrun("Memo", test_memo);
+  lrun("Let", test_let);
+  lrun("Records", test_records);
+  lrun("Storage", test_storage);
+  lrun("Parallel", test_parallel);
+  lrun("Stats", test_stats);
+  lrun("Top k", test_topk);
+  lrun("Group", test_group);
+  lrun("Sweep", test_sweep);
   lresults();
 
   return lfails != 0;
@@ -0,0 +1,121 @@
+#include "tinyintegerexpr.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Compiles expressions to C ahead of time.
+ *
+ *     tiec -v a,b,c -o rules.h score="a*3 + b" mask="a & 255"
+ *
+ * Each name=expression becomes score(const int *vars) and score_batch(),
+ * where vars[i] is the value of the i-th variable given with -v. Without -o the
+ * code goes to stdout. Nothing is written unless every expression compiles. */
+
+#define MAX_VARIABLES 64
+
+static void emit_string(FILE *out, const char *name, const char *text) {
+    fprintf(out, "static const char %s_source[] = \"", name);
+    for (; *text; ++text) {
+        if (*text == '"' || *text == '\\') fputc('\\', out);
+        fputc(*text, out);
+    }
+    fprintf(out, "\";\n\n");
+}
+
+static int copy(FILE *from, FILE *to) {
+    char buf[4096];
+    size_t n;
+    rewind(from);
+    while ((n = fread(buf, 1, sizeof(buf), from)) > 0) {
+        if (fwrite(buf, 1, n, to) != n) return -1;
+    }
+    return ferror(from) || fflush(to) ? -1 : 0;
+}
+
+static int emit(FILE *out, int first, int argc, char *argv[], tie_variable *vars, int var_count) {
+    int i;
+
+    fprintf(out, "/* Generated by tiec. */\n\n");
+    for (i = first; i < argc; ++i) {
+        char *eq = strchr(argv[i], '=');
+        if (!eq || eq == argv[i]) {
+            fprintf(stderr, "Expected name=expression, got %s\n", argv[i]);
+            return -1;
+        }
+        *eq = '\0';
+
+        int err;
+        tie_expression *n = tie_compile(eq + 1, vars, var_count, &err);
+        if (!n) {
+            fprintf(stderr, "%s: error near character %d\n", argv[i], err);
+            return -1;
+        }
+        if (tie_emit_c(n, argv[i], vars, var_count, out)) {
+            fprintf(stderr, "%s: cannot be emitted as C\n", argv[i]);
+            tie_free(n);
+            return -1;
+        }
+        emit_string(out, argv[i], eq + 1);
+        tie_free(n);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    static int values[MAX_VARIABLES];
+    static tie_variable vars[MAX_VARIABLES];
+    const char *path = 0;
+    char *names = 0;
+    int var_count = 0;
+    int i;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-o") == 0) {
+            path = argv[i + 1];
+        } else if (strcmp(argv[i], "-v") == 0 && !names) {
+            names = strdup(argv[i + 1]);
+            char *name = strtok(names, ",");
+            while (name && var_count < MAX_VARIABLES) {
+                vars[var_count].name = name;
+                vars[var_count].address = &values[var_count];
+                vars[var_count].type = TIE_VARIABLE;
+                ++var_count;
+                name = strtok(0, ",");
+            }
+        } else {
+            break;
+        }
+    }
+
+    if (i >= argc) {
+        fprintf(stderr, "Usage: tiec [-v var1,var2,...] [-o file] name=\"expression\" ...\n");
+        return 1;
+    }
+
+    /* The code is built up in a temporary file, so a failure leaves no partial output. */
+    FILE *code = tmpfile();
+    if (!code) {
+        perror("tiec");
+        return 1;
+    }
+    int failed = emit(code, i, argc, argv, vars, var_count);
+    if (!failed) {
+        FILE *out = path ? fopen(path, "w") : stdout;
+        if (!out) {
+            perror(path);
+            failed = 1;
+        } else {
+            failed = copy(code, out);
+            if (path && fclose(out)) failed = 1;
+            if (failed) {
+                fprintf(stderr, "tiec: cannot write %s\n", path ? path : "output");
+                if (path) remove(path);
+            }
+        }
+    }
+
+    fclose(code);
+    free(names);
+    return failed != 0;
+}
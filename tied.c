@@ -0,0 +1,366 @@
+#define _GNU_SOURCE
+#include "tinyintegerexpr.h"
+#include "tied.h"
+#include <errno.h>
+#include <limits.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/* Evaluation daemon. Listens on a Unix domain socket and serves the requests of tied.h:
+ *
+ *     tied -s /tmp/tied.sock -v a,b,c [-c cache_capacity]
+ *
+ * Expressions are compiled against the variables given with -v, through a tie_cache, so
+ * clients compiling the same text share one tree. One thread runs an epoll loop; every
+ * request that has arrived on a connection is answered before its replies are written.
+ * A client that shuts down its end still gets the replies to everything it sent. */
+
+#define MAX_VARIABLES 64
+#define MAX_EVENTS 64
+#define READ_SIZE 65536
+/* Stop taking requests from a client that is not reading its replies. */
+#define MAX_PENDING_OUTPUT (16u << 20)
+
+typedef struct buffer {
+    char *data;
+    size_t used;
+    size_t size;
+} buffer;
+
+typedef struct connection {
+    int fd;
+    buffer in;
+    buffer out;
+    size_t sent;
+    int reading; /* Waiting for EPOLLIN. */
+    int writing; /* Waiting for EPOLLOUT. */
+    int eof;     /* The client has shut down its end. */
+    tie_cache_entry **handles;
+    uint32_t handle_count;
+} connection;
+
+static int values[MAX_VARIABLES];
+static tie_variable vars[MAX_VARIABLES];
+static int var_count;
+static tie_cache *cache;
+static int epoll_fd;
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+    (void) sig;
+    stopping = 1;
+}
+
+static int reserve(buffer *b, size_t more) {
+    if (b->used + more <= b->size) return 0;
+    size_t size = b->size ? b->size : READ_SIZE;
+    while (size < b->used + more) size *= 2;
+    char *data = realloc(b->data, size);
+    if (!data) return -1;
+    b->data = data;
+    b->size = size;
+    return 0;
+}
+
+static tied_reply *begin_reply(connection *c, uint32_t id, size_t size) {
+    /* Appends a reply with room for size bytes of payload. */
+    if (reserve(&c->out, sizeof(tied_reply) + size)) return 0;
+    tied_reply *r = (tied_reply *) (c->out.data + c->out.used);
+    r->size = (uint32_t) size;
+    r->id = id;
+    r->status = TIED_OK;
+    c->out.used += sizeof(tied_reply) + size;
+    return r;
+}
+
+static int reply_status(connection *c, uint32_t id, int32_t status) {
+    tied_reply *r = begin_reply(c, id, 0);
+    if (!r) return -1;
+    r->status = status;
+    return 0;
+}
+
+static int compile(connection *c, const tied_request *q, const char *text) {
+    uint32_t h;
+    int err;
+
+    if (q->size == 0 || !memchr(text, 0, q->size)) return reply_status(c, q->id, TIED_EREQUEST);
+
+    for (h = 0; h < c->handle_count && c->handles[h]; ++h) {}
+    if (h == c->handle_count) {
+        tie_cache_entry **handles = realloc(c->handles, sizeof(*handles) * (c->handle_count * 2 + 8));
+        if (!handles) return reply_status(c, q->id, TIED_ENOMEM);
+        memset(handles + c->handle_count, 0, sizeof(*handles) * (c->handle_count + 8));
+        c->handles = handles;
+        c->handle_count = c->handle_count * 2 + 8;
+    }
+
+    tie_cache_entry *e = tie_cache_acquire(cache, text, &err);
+    if (!e) return reply_status(c, q->id, err > 0 ? err : TIED_ENOMEM);
+    c->handles[h] = e;
+
+    tied_reply *r = begin_reply(c, q->id, sizeof(uint32_t));
+    if (!r) return -1;
+    memcpy(r + 1, &h, sizeof(h));
+    return 0;
+}
+
+static const tie_expression *find_handle(const connection *c, const char *payload) {
+    uint32_t h;
+    memcpy(&h, payload, sizeof(h));
+    return h < c->handle_count && c->handles[h] ? tie_cache_expression(c->handles[h]) : 0;
+}
+
+static int eval(connection *c, const tied_request *q, const char *payload) {
+    /* The columns are used where they are in the input buffer, and the results are
+     * written straight into the output buffer. */
+    tie_column columns[MAX_VARIABLES + 1];
+    tied_eval e;
+    int i;
+
+    if (q->size < sizeof(e)) return reply_status(c, q->id, TIED_EREQUEST);
+    memcpy(&e, payload, sizeof(e));
+    if (e.rows > TIED_MAX_PAYLOAD / sizeof(int32_t) || e.rows > INT_MAX) return reply_status(c, q->id, TIED_EREQUEST);
+    if (q->size != sizeof(e) + (uint64_t) e.rows * var_count * sizeof(int)) {
+        return reply_status(c, q->id, TIED_EREQUEST);
+    }
+    const tie_expression *n = find_handle(c, payload);
+    if (!n) return reply_status(c, q->id, TIED_EHANDLE);
+
+    const int *data = (const int *) (payload + sizeof(e));
+    for (i = 0; i < var_count; ++i) {
+        columns[i].bound = &values[i];
+        columns[i].data = data + (size_t) i * e.rows;
+    }
+    columns[var_count].bound = 0;
+
+    /* Checked, so that a zero divisor from one client cannot bring the daemon down. */
+    tied_reply *r = begin_reply(c, q->id, (size_t) e.rows * sizeof(int));
+    if (!r) return -1;
+    const int errors = tie_eval_batch_checked(n, columns, (int) e.rows, (int *) (r + 1), 0);
+    if (errors < 0) {
+        c->out.used -= (size_t) e.rows * sizeof(int);
+        r->size = 0;
+        r->status = TIED_ENOMEM;
+    } else {
+        r->status = errors;
+    }
+    return 0;
+}
+
+static int release(connection *c, const tied_request *q, const char *payload) {
+    uint32_t h;
+    if (q->size != sizeof(h)) return reply_status(c, q->id, TIED_EREQUEST);
+    memcpy(&h, payload, sizeof(h));
+    if (h >= c->handle_count || !c->handles[h]) return reply_status(c, q->id, TIED_EHANDLE);
+    tie_cache_release(c->handles[h]);
+    c->handles[h] = 0;
+    return reply_status(c, q->id, TIED_OK);
+}
+
+static int process(connection *c) {
+    /* Answers every complete request in the input buffer. Returns -1 to drop the client. */
+    size_t at = 0;
+    int ret = 0;
+
+    while (ret == 0 && c->in.used - at >= sizeof(tied_request) && c->out.used - c->sent < MAX_PENDING_OUTPUT) {
+        tied_request q;
+        memcpy(&q, c->in.data + at, sizeof(q));
+        if (q.size > TIED_MAX_PAYLOAD || q.size % 4) return -1;
+        if (c->in.used - at < sizeof(q) + q.size) break;
+
+        const char *payload = c->in.data + at + sizeof(q);
+        switch (q.op) {
+            case TIED_COMPILE: ret = compile(c, &q, payload); break;
+            case TIED_EVAL: ret = eval(c, &q, payload); break;
+            case TIED_RELEASE: ret = release(c, &q, payload); break;
+            default: ret = reply_status(c, q.id, TIED_EREQUEST); break;
+        }
+        at += sizeof(q) + q.size;
+    }
+
+    memmove(c->in.data, c->in.data + at, c->in.used - at);
+    c->in.used -= at;
+    return ret;
+}
+
+static int watch(connection *c) {
+    /* Waits for EPOLLOUT while replies are queued, and for EPOLLIN unless the client has
+     * shut down its end or is not reading its replies. */
+    const int reading = !c->eof && c->out.used - c->sent < MAX_PENDING_OUTPUT;
+    const int writing = c->sent < c->out.used;
+    if (reading == c->reading && writing == c->writing) return 0;
+
+    struct epoll_event ev;
+    ev.events = (reading ? EPOLLIN : 0) | (writing ? EPOLLOUT : 0);
+    ev.data.ptr = c;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_MOD, c->fd, &ev)) return -1;
+    c->reading = reading;
+    c->writing = writing;
+    return 0;
+}
+
+static int flush(connection *c) {
+    /* Writes what the socket takes, and waits for EPOLLOUT if there is more. */
+    while (c->sent < c->out.used) {
+        const ssize_t n = send(c->fd, c->out.data + c->sent, c->out.used - c->sent, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EAGAIN) return -1;
+        if (n < 0) break;
+        c->sent += (size_t) n;
+    }
+    if (c->sent == c->out.used) c->sent = c->out.used = 0;
+    return watch(c);
+}
+
+static void drop(connection *c) {
+    uint32_t h;
+    for (h = 0; h < c->handle_count; ++h) {
+        if (c->handles[h]) tie_cache_release(c->handles[h]);
+    }
+    close(c->fd);
+    free(c->handles);
+    free(c->in.data);
+    free(c->out.data);
+    free(c);
+}
+
+static int on_readable(connection *c) {
+    /* Answers requests as they arrive, and leaves the rest in the socket once the replies
+     * back up, so neither buffer grows without bound. */
+    while (c->out.used - c->sent < MAX_PENDING_OUTPUT) {
+        if (reserve(&c->in, READ_SIZE)) return -1;
+        const ssize_t n = read(c->fd, c->in.data + c->in.used, c->in.size - c->in.used);
+        if (n == 0) c->eof = 1;
+        if (n == 0 || (n < 0 && errno == EAGAIN)) break;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        c->in.used += (size_t) n;
+        if (process(c)) return -1;
+    }
+    return 0;
+}
+
+static void on_accept(int listen_fd) {
+    for (;;) {
+        const int fd = accept4(listen_fd, 0, 0, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) return;
+
+        connection *c = calloc(1, sizeof(connection));
+        struct epoll_event ev;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (!c || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev)) {
+            close(fd);
+            free(c);
+            continue;
+        }
+        c->fd = fd;
+        c->reading = 1;
+    }
+}
+
+static int parse_variables(char *names) {
+    char *name = strtok(names, ",");
+    while (name) {
+        if (var_count == MAX_VARIABLES) return -1;
+        vars[var_count].name = name;
+        vars[var_count].address = &values[var_count];
+        vars[var_count].type = TIE_VARIABLE;
+        ++var_count;
+        name = strtok(0, ",");
+    }
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = "/tmp/tied.sock";
+    int capacity = 1024;
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-s") == 0) path = argv[i + 1];
+        else if (strcmp(argv[i], "-c") == 0) capacity = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "-v") == 0 && parse_variables(argv[i + 1]) == 0) continue;
+        else break;
+    }
+    if (i < argc || capacity < 1) {
+        fprintf(stderr, "Usage: tied [-s socket] [-v var1,var2,...] [-c cache_capacity]\n");
+        return 1;
+    }
+
+    cache = tie_cache_new(vars, var_count, capacity);
+    if (!cache) {
+        fprintf(stderr, "tied: out of memory\n");
+        return 1;
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "tied: socket path too long\n");
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    const int listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) || listen(listen_fd, 128)) {
+        perror("tied");
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = 0;
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev)) {
+        perror("tied");
+        return 1;
+    }
+
+    fprintf(stderr, "tied: listening on %s with %d variables\n", path, var_count);
+    while (!stopping) {
+        struct epoll_event events[MAX_EVENTS];
+        const int n = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("tied");
+            break;
+        }
+
+        for (i = 0; i < n; ++i) {
+            connection *c = events[i].data.ptr;
+            if (!c) {
+                on_accept(listen_fd);
+                continue;
+            }
+            int failed = (events[i].events & EPOLLERR) != 0;
+            if (!failed && !c->eof && (events[i].events & (EPOLLIN | EPOLLHUP))) failed = on_readable(c);
+            /* Writing may make room for requests that were held back. */
+            if (!failed && (events[i].events & EPOLLOUT)) failed = flush(c) || process(c);
+            if (!failed) failed = flush(c);
+            /* A client that has shut down its end is closed once its replies are out. */
+            if (failed || (c->eof && c->out.used == 0)) drop(c);
+        }
+    }
+
+    close(listen_fd);
+    unlink(path);
+    tie_cache_free(cache);
+    return 0;
+}
@@ -0,0 +1,51 @@
+#ifndef TIED_H
+#define TIED_H
+
+#include <stdint.h>
+
+/* Wire format of tied, the evaluation daemon, and of its load generator.
+ *
+ * Every request is a tied_request header followed by size bytes of payload, and every
+ * reply a tied_reply header followed by its payload. Both ends are on one machine, so
+ * numbers are in host byte order. Payloads are padded to a multiple of 4 bytes. A client
+ * may send any number of requests without waiting; replies come back in order and carry
+ * the id of their request. */
+
+enum {
+    TIED_COMPILE = 1, /* Payload: NUL-terminated expression. Reply: a uint32 handle. */
+    TIED_EVAL = 2,    /* Payload: tied_eval, then one column of rows int32 values per variable. */
+                      /* Reply: rows int32 results. */
+    TIED_RELEASE = 3  /* Payload: a uint32 handle. Reply: empty. */
+};
+
+/* Reply status. A failed compile gives the position of the error instead, which is > 0. An eval */
+/* in which some rows overflowed or divided by zero still returns every row, with the TIE_ERROR_* */
+/* conditions of all rows (> 0) as its status. */
+enum {
+    TIED_OK = 0,
+    TIED_EREQUEST = -1, /* Unknown op, or a payload of the wrong size. */
+    TIED_EHANDLE = -2,  /* No such handle on this connection. */
+    TIED_ENOMEM = -3
+};
+
+typedef struct tied_request {
+    uint32_t size;
+    uint32_t id;
+    uint32_t op;
+} tied_request;
+
+typedef struct tied_reply {
+    uint32_t size;
+    uint32_t id;
+    int32_t status;
+} tied_reply;
+
+typedef struct tied_eval {
+    uint32_t handle;
+    uint32_t rows;
+} tied_eval;
+
+/* Larger requests close the connection. */
+#define TIED_MAX_PAYLOAD (64u << 20)
+
+#endif /*TIED_H*/
@@ -0,0 +1,246 @@
+#include "tied.h"
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Load generator for tied.
+ *
+ *     tieload [-s socket] [-v vars] [-r rows] [-n requests] [-d depth] [-c connections] "a*3 + b"
+ *
+ * Each connection compiles the expression, then keeps depth evaluations of rows random
+ * rows in flight until it has sent its share of the requests. Prints the throughput and
+ * the latency percentiles over all requests. Before that, every connection sends a batch
+ * that divides by zero and overflows, and fails if the daemon does not answer it. */
+
+typedef struct worker {
+    pthread_t thread;
+    int index;
+    int requests;
+    double *latencies;
+    int errors;
+    int failed;
+} worker;
+
+static const char *path = "/tmp/tied.sock";
+static const char *expression;
+static int var_count = 1;
+static int rows = 256;
+static int depth = 16;
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int send_all(int fd, const void *data, size_t size) {
+    const char *p = data;
+    while (size) {
+        const ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+        if (n <= 0) return -1;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *data, size_t size) {
+    char *p = data;
+    while (size) {
+        const ssize_t n = recv(fd, p, size, 0);
+        if (n <= 0) return -1;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+static int connect_to_daemon() {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+static int compile(int fd, uint32_t *handle) {
+    const size_t length = strlen(expression) + 1;
+    const size_t size = (length + 3) & ~(size_t) 3;
+    char *request = calloc(1, sizeof(tied_request) + size);
+    tied_request q = {(uint32_t) size, 0, TIED_COMPILE};
+    tied_reply r;
+
+    memcpy(request, &q, sizeof(q));
+    memcpy(request + sizeof(q), expression, length);
+    const int failed = send_all(fd, request, sizeof(q) + size) || recv_all(fd, &r, sizeof(r));
+    free(request);
+    if (failed) return -1;
+    if (r.status != TIED_OK) {
+        fprintf(stderr, "tieload: compile failed with status %d\n", r.status);
+        return -1;
+    }
+    return recv_all(fd, handle, sizeof(*handle));
+}
+
+static int probe(int fd, uint32_t handle) {
+    /* Rows where a/b divides by zero (7/0) and overflows (INT_MIN/-1): the first variable
+     * holds the dividends, every other one the divisors. */
+    const size_t payload = sizeof(tied_eval) + (size_t) 2 * var_count * sizeof(int);
+    char *request = malloc(sizeof(tied_request) + payload);
+    tied_request q = {(uint32_t) payload, 0, TIED_EVAL};
+    tied_eval e = {handle, 2};
+    tied_reply r;
+    int results[2], i;
+
+    memcpy(request, &q, sizeof(q));
+    memcpy(request + sizeof(q), &e, sizeof(e));
+    int *data = (int *) (request + sizeof(q) + sizeof(e));
+    for (i = 0; i < var_count; ++i) {
+        data[2 * i] = i ? 0 : 7;
+        data[2 * i + 1] = i ? -1 : INT_MIN;
+    }
+    const int failed = send_all(fd, request, sizeof(q) + payload) || recv_all(fd, &r, sizeof(r)) ||
+                       r.size > sizeof(results) || recv_all(fd, results, r.size);
+    free(request);
+    if (failed || r.status < 0) {
+        fprintf(stderr, "tieload: no answer to a batch that divides by zero\n");
+        return -1;
+    }
+    return 0;
+}
+
+static void *run(void *arg) {
+    worker *w = arg;
+    const size_t payload = sizeof(tied_eval) + (size_t) rows * var_count * sizeof(int);
+    char *request = malloc(sizeof(tied_request) + payload);
+    int *results = malloc(sizeof(int) * rows);
+    double *started = malloc(sizeof(double) * depth);
+    uint32_t handle;
+    int sent = 0, received = 0, i;
+
+    const int fd = connect_to_daemon();
+    if (fd < 0 || compile(fd, &handle) || probe(fd, handle)) {
+        w->failed = 1;
+        goto done;
+    }
+
+    /* The same values are sent every time; the daemon does not know that. */
+    unsigned seed = (unsigned) w->index * 7919u + 1;
+    int *data = (int *) (request + sizeof(tied_request) + sizeof(tied_eval));
+    for (i = 0; i < rows * var_count; ++i) data[i] = (int) (rand_r(&seed) % 2001) - 1000;
+    tied_eval e = {handle, (uint32_t) rows};
+    memcpy(request + sizeof(tied_request), &e, sizeof(e));
+
+    while (received < w->requests) {
+        while (sent < w->requests && sent - received < depth) {
+            tied_request q = {(uint32_t) payload, (uint32_t) sent, TIED_EVAL};
+            memcpy(request, &q, sizeof(q));
+            started[sent % depth] = now();
+            if (send_all(fd, request, sizeof(q) + payload)) {
+                w->failed = 1;
+                goto done;
+            }
+            ++sent;
+        }
+
+        tied_reply r;
+        if (recv_all(fd, &r, sizeof(r)) || r.id != (uint32_t) received || r.size > sizeof(int) * rows ||
+            recv_all(fd, results, r.size)) {
+            w->failed = 1;
+            goto done;
+        }
+        w->latencies[received] = now() - started[received % depth];
+        if (r.status != TIED_OK) ++w->errors;
+        ++received;
+    }
+
+done:
+    w->requests = received;
+    if (fd >= 0) close(fd);
+    free(started);
+    free(results);
+    free(request);
+    return 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    const double x = *(const double *) a, y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+int main(int argc, char *argv[])
+{
+    int requests = 100000;
+    int connections = 1;
+    int i;
+
+    for (i = 1; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        const char *value = argv[i + 1];
+        if (strcmp(argv[i], "-s") == 0) path = value;
+        else if (strcmp(argv[i], "-v") == 0) var_count = atoi(value);
+        else if (strcmp(argv[i], "-r") == 0) rows = atoi(value);
+        else if (strcmp(argv[i], "-n") == 0) requests = atoi(value);
+        else if (strcmp(argv[i], "-d") == 0) depth = atoi(value);
+        else if (strcmp(argv[i], "-c") == 0) connections = atoi(value);
+        else break;
+    }
+    if (i + 1 != argc || var_count < 0 || rows < 1 || requests < 1 || depth < 1 || connections < 1) {
+        fprintf(stderr, "Usage: tieload [-s socket] [-v vars] [-r rows] [-n requests] [-d depth] "
+                        "[-c connections] expression\n");
+        return 1;
+    }
+    expression = argv[i];
+
+    worker *workers = calloc(connections, sizeof(worker));
+    double *latencies = malloc(sizeof(double) * requests);
+    int total = 0, errors = 0, failed = 0;
+
+    const double start = now();
+    for (i = 0; i < connections; ++i) {
+        workers[i].index = i;
+        workers[i].requests = requests / connections + (i < requests % connections);
+        workers[i].latencies = latencies + total;
+        total += workers[i].requests;
+        pthread_create(&workers[i].thread, 0, run, &workers[i]);
+    }
+
+    /* Pack the latencies of the requests that completed. */
+    total = 0;
+    for (i = 0; i < connections; ++i) {
+        pthread_join(workers[i].thread, 0);
+        memmove(latencies + total, workers[i].latencies, sizeof(double) * workers[i].requests);
+        total += workers[i].requests;
+        errors += workers[i].errors;
+        failed += workers[i].failed;
+    }
+    const double elapsed = now() - start;
+
+    if (failed) fprintf(stderr, "tieload: %d of %d connections failed\n", failed, connections);
+    if (total == 0) return 1;
+
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    printf("%d requests of %d rows in %.3f s over %d connections, depth %d\n", total, rows, elapsed,
+           connections, depth);
+    printf("%.0f requests/s, %.0f rows/s, %d errors\n", total / elapsed, (double) total * rows / elapsed, errors);
+    printf("latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+           latencies[(int) (total * 0.5)] * 1e6, latencies[(int) (total * 0.9)] * 1e6,
+           latencies[(int) (total * 0.99)] * 1e6, latencies[(int) (total * 0.999)] * 1e6,
+           latencies[total - 1] * 1e6);
+
+    free(latencies);
+    free(workers);
+    return failed != 0;
+}
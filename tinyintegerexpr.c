@@ -9,6 +9,11 @@
 #include <string.h>
 #include <stdio.h>
 #include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
 
 #ifndef NAN
 #define NAN (0.0/0.0)
@@ -23,14 +28,35 @@ typedef int (*tie_fun2)(int, int);
 
 enum {
   NULL_TOKEN = TIE_CLOSURE7 + 1, ERROR_TOKEN, END_TOKEN, SEPARATOR_TOKEN,
-  OPEN_TOKEN, CLOSE_TOKEN, NUMBER_TOKEN, VARIABLE_TOKEN, INFIX_TOKEN
+  OPEN_TOKEN, CLOSE_TOKEN, NUMBER_TOKEN, VARIABLE_TOKEN, INFIX_TOKEN, LET_TOKEN, TEMP_TOKEN
 };
 
 
 enum {
-  TIE_CONSTANT = 1
+  TIE_CONSTANT = 1,
+
+  /* Set on function nodes that carry a tie_batch_function after their context. */
+  TIE_FLAG_BATCH = 256,
+  /* Set on variable nodes that carry a tie_range in parameters[0]. */
+  TIE_FLAG_RANGE = 512,
+  /* The operation cannot overflow or trap, so checked evaluation may skip its checks. */
+  TIE_FLAG_SAFE = 1024,
+  /* Every value in this subtree fits in 16 bits, so batches may use 16-bit lanes. */
+  TIE_FLAG_NARROW = 2048,
+  /* Set on the closures that implement "name = value, ...": the binding (arity 2, context is */
+  /* the slot), reads of the name (arity 0) and stores to output variables (arity 1). */
+  TIE_FLAG_LET = 4096,
+  /* Set by tie_parallelize on subtrees that tie_eval_parallel hands to the pool. */
+  TIE_FLAG_TASK = 8192
 };
 
+/* Variable nodes keep the type their address points to (TIE_INT32 and so on) in these bits. */
+#define STORAGE_SHIFT 16
+#define STORAGE(TYPE) (((TYPE) >> STORAGE_SHIFT) & 7)
+
+/* Names an expression may bind with "name = value". */
+#define MAX_LETS 64
+
 
 typedef struct state {
   const char *start;
@@ -42,9 +68,34 @@ typedef struct state {
     const void *function;
   };
   void *context;
+  tie_batch_function batch;
+  int storage;
+  const tie_range *range;
 
   const tie_variable *lookup;
   int lookup_len;
+
+  /* Caller-provided memory for the tree; nodes are taken from it rather than from malloc. */
+  char *arena;
+  size_t arena_left;
+
+  /* Limits from tie_compile_limited (0 for none) and what has been used so far. */
+  tie_limits limits;
+  int tokens;
+  int depth;
+  int nodes;
+  int over_limit;
+
+  /* The name of a LET_TOKEN, and the names bound where the parser is, innermost last. */
+  const char *let_name;
+  int let_len;
+  struct {
+    const char *name;
+    int len;
+    int slot;
+  } lets[MAX_LETS];
+  int let_depth;
+  int let_count;
 } state;
 
 
@@ -54,15 +105,118 @@ typedef struct state {
 #define IS_FUNCTION(TYPE) (((TYPE) & TIE_FUNCTION0) != 0)
 #define IS_CLOSURE(TYPE) (((TYPE) & TIE_CLOSURE0) != 0)
 #define ARITY(TYPE) ( ((TYPE) & (TIE_FUNCTION0 | TIE_CLOSURE0)) ? ((TYPE) & 0x00000007) : 0 )
-#define NEW_EXPR(type, ...) new_expr((type), (const tie_expression*[]){__VA_ARGS__})
+#define BATCH_SLOT(TYPE) (ARITY(TYPE) + IS_CLOSURE(TYPE))
+#define MEMO_SLOT(TYPE) (BATCH_SLOT(TYPE) + (((TYPE) & TIE_FLAG_BATCH) != 0))
+#define NEW_EXPR(s, type, ...) new_expr((s), (type), (const tie_expression*[]){__VA_ARGS__})
 #define CHECK_NULL(ptr, ...) if ((ptr) == NULL) { __VA_ARGS__; return NULL; }
 
-static tie_expression *new_expr(const int type, const tie_expression *parameters[]) {
+/* Counters for tie_get_stats. Each thread counts in its own block, which only it writes,
+ * so counting takes no atomic read-modify-write; tie_get_stats adds up the blocks with
+ * relaxed loads. A thread links its block into a global list the first time it counts,
+ * and its counts move to the totals of exited threads when it ends. */
+typedef struct thread_stats {
+  unsigned long long compiles, compile_failures, nodes_allocated, evaluations, nodes_evaluated, folded_nodes,
+      cache_hits, cache_misses;
+  unsigned long long counted_evaluations; /* Evaluations whose nodes are in nodes_evaluated. */
+  long long bytes_live; /* Negative in threads that free more than they allocate. */
+  struct thread_stats *next, **prev;
+  int linked;
+} thread_stats;
+
+static __thread thread_stats local_stats;
+static thread_stats exited_stats;
+static thread_stats *live_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+
+#define STAT_ADD(FIELD, N) __atomic_store_n(&local_stats.FIELD, local_stats.FIELD + (N), __ATOMIC_RELAXED)
+/* Counts in the calling thread. Evaluators count nodes with STAT_ADD alone, since their */
+/* entry points have already linked the block. */
+#define COUNT(FIELD, N) do { if (!local_stats.linked) link_stats(); STAT_ADD(FIELD, N); } while (0)
+/* Counting every node a single evaluation visits costs a store per node, so it is only done */
+/* when built with TIE_NODE_STATS. Batches count the nodes of the tree once per call. */
+#ifdef TIE_NODE_STATS
+#define COUNT_NODE() STAT_ADD(nodes_evaluated, 1)
+#define COUNT_EVALUATION() do { COUNT(evaluations, 1); STAT_ADD(counted_evaluations, 1); } while (0)
+#else
+#define COUNT_NODE()
+#define COUNT_EVALUATION() COUNT(evaluations, 1)
+#endif
+
+static void add_stats(thread_stats *to, const thread_stats *from) {
+  to->compiles += __atomic_load_n(&from->compiles, __ATOMIC_RELAXED);
+  to->compile_failures += __atomic_load_n(&from->compile_failures, __ATOMIC_RELAXED);
+  to->nodes_allocated += __atomic_load_n(&from->nodes_allocated, __ATOMIC_RELAXED);
+  to->evaluations += __atomic_load_n(&from->evaluations, __ATOMIC_RELAXED);
+  to->nodes_evaluated += __atomic_load_n(&from->nodes_evaluated, __ATOMIC_RELAXED);
+  to->counted_evaluations += __atomic_load_n(&from->counted_evaluations, __ATOMIC_RELAXED);
+  to->folded_nodes += __atomic_load_n(&from->folded_nodes, __ATOMIC_RELAXED);
+  to->cache_hits += __atomic_load_n(&from->cache_hits, __ATOMIC_RELAXED);
+  to->cache_misses += __atomic_load_n(&from->cache_misses, __ATOMIC_RELAXED);
+  to->bytes_live += __atomic_load_n(&from->bytes_live, __ATOMIC_RELAXED);
+}
+
+static void unlink_stats(void *arg) {
+  thread_stats *t = arg;
+  pthread_mutex_lock(&stats_lock);
+  add_stats(&exited_stats, t);
+  *t->prev = t->next;
+  if (t->next) t->next->prev = t->prev;
+  pthread_mutex_unlock(&stats_lock);
+  memset(t, 0, sizeof(*t));
+}
+
+static void create_stats_key(void) {
+  pthread_key_create(&stats_key, unlink_stats);
+}
+
+static void link_stats(void) {
+  pthread_once(&stats_once, create_stats_key);
+  pthread_mutex_lock(&stats_lock);
+  local_stats.next = live_stats;
+  local_stats.prev = &live_stats;
+  if (live_stats) live_stats->prev = &local_stats.next;
+  live_stats = &local_stats;
+  local_stats.linked = 1;
+  pthread_mutex_unlock(&stats_lock);
+  pthread_setspecific(stats_key, &local_stats);
+}
+
+static int expr_size(const int type) {
+  const int psize = sizeof(void *) * ARITY(type);
+  return (sizeof(tie_expression) - sizeof(void *)) + psize + (IS_CLOSURE(type) ? sizeof(void *) : 0)
+         + ((type & (TIE_FLAG_BATCH | TIE_FLAG_RANGE)) ? sizeof(void *) : 0)
+         + ((type & TIE_FLAG_MEMO) ? sizeof(void *) : 0);
+}
+
+static tie_expression *attach_memo(tie_expression *n);
+static void release_memo(void *m);
+
+static tie_expression *new_expr(state *s, const int type, const tie_expression *parameters[]) {
+  /* Allocates from the parser's arena when it has one (s may be 0). */
   const int arity = ARITY(type);
   const int psize = sizeof(void *) * arity;
-  const int size = (sizeof(tie_expression) - sizeof(void *)) + psize + (IS_CLOSURE(type) ? sizeof(void *) : 0);
-  tie_expression *ret = malloc(size);
-  CHECK_NULL(ret);
+  const int size = expr_size(type);
+  tie_expression *ret;
+
+  if (s && s->limits.max_nodes && ++s->nodes > s->limits.max_nodes) {
+    s->over_limit = 1;
+    return NULL;
+  }
+
+  if (s && s->arena) {
+    const size_t aligned = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if (aligned > s->arena_left) return NULL;
+    ret = (tie_expression *) s->arena;
+    s->arena += aligned;
+    s->arena_left -= aligned;
+  } else {
+    ret = malloc(size);
+    CHECK_NULL(ret);
+    COUNT(nodes_allocated, 1);
+    COUNT(bytes_live, size);
+  }
 
   memset(ret, 0, size);
   if (arity && parameters) {
@@ -79,6 +233,7 @@ static tie_expression *new_expr(const int type, const tie_expression *parameters
 
 void tie_free_parameters(tie_expression *n) {
   if (!n) return;
+  if (n->type & TIE_FLAG_MEMO) release_memo(n->parameters[MEMO_SLOT(n->type)]);
   switch (TYPE_MASK(n->type)) {
     case TIE_FUNCTION7:
     case TIE_CLOSURE7:
@@ -110,17 +265,111 @@ void tie_free_parameters(tie_expression *n) {
 void tie_free(tie_expression *n) {
   if (!n) return;
   tie_free_parameters(n);
+  COUNT(bytes_live, -expr_size(n->type));
   free(n);
 }
 
+static void retype(tie_expression *n, int type) {
+  /* Changes the type of n in place, which may leave some of its memory unused. */
+  COUNT(bytes_live, -expr_size(n->type));
+  n->type = type;
+  COUNT(bytes_live, expr_size(type));
+}
+
+static int load_value(const void *address, int storage) {
+  /* Reads a variable of the given TIE_INT32, TIE_UINT8, ... type as an int. */
+  switch (storage) {
+    case TIE_INT8: return *(const signed char *) address;
+    case TIE_UINT8: return *(const unsigned char *) address;
+    case TIE_INT16: return *(const short *) address;
+    case TIE_UINT16: return *(const unsigned short *) address;
+    case TIE_UINT32: return (int) *(const unsigned *) address;
+    case TIE_INT64: return (int) *(const long long *) address;
+    default: return *(const int *) address;
+  }
+}
+
+static size_t storage_size(int storage) {
+  static const unsigned char sizes[] = {sizeof(int), 1, 1, 2, 2, sizeof(int), sizeof(long long)};
+  return storage >= 0 && storage <= TIE_INT64 ? sizes[storage] : sizeof(int);
+}
+
+/* Values of the names bound by "name = value" in the current thread, by slot. */
+static __thread int let_values[MAX_LETS];
+
+static int let_read(void *slot) {
+  return let_values[(size_t) slot];
+}
+
+static int let_bind(void *slot, int value, int body) {
+  /* Only marks the node: evaluators bind the value before they evaluate the body. */
+  (void) slot;
+  (void) value;
+  return body;
+}
+
+static int let_output(void *address, int value) {
+  return *(int *) address = value;
+}
+
 static int iffunc(int a, int b, int c) {
   return a ? b : c;
 }
 
+static int absfunc(int a) {
+  return (int) (a < 0 ? 0u - (unsigned) a : (unsigned) a);
+}
+
+static int bswap(int a) {
+  return (int) __builtin_bswap32((unsigned) a);
+}
+
+static int clamp(int a, int lo, int hi) {
+  return a < lo ? lo : a > hi ? hi : a;
+}
+
+static int clz(int a) {
+  return a ? __builtin_clz((unsigned) a) : 32;
+}
+
+static int ctz(int a) {
+  return a ? __builtin_ctz((unsigned) a) : 32;
+}
+
+static int max(int a, int b) {
+  return a > b ? a : b;
+}
+
+static int min(int a, int b) {
+  return a < b ? a : b;
+}
+
+static int popcount(int a) {
+  return __builtin_popcount((unsigned) a);
+}
+
+static int rotl(int a, int b) {
+  return (int) (((unsigned) a << (b & 31)) | ((unsigned) a >> (-b & 31)));
+}
+
+static int rotr(int a, int b) {
+  return (int) (((unsigned) a >> (b & 31)) | ((unsigned) a << (-b & 31)));
+}
+
 static const tie_variable functions[] = {
     /* must be in alphabetical order */
-    {"if", iffunc, TIE_FUNCTION3 | TIE_FLAG_PURE, 0},
-    {0,    0,      0,                             0}
+    {"abs",      absfunc,  TIE_FUNCTION1 | TIE_FLAG_PURE, 0},
+    {"bswap",    bswap,    TIE_FUNCTION1 | TIE_FLAG_PURE, 0},
+    {"clamp",    clamp,    TIE_FUNCTION3 | TIE_FLAG_PURE, 0},
+    {"clz",      clz,      TIE_FUNCTION1 | TIE_FLAG_PURE, 0},
+    {"ctz",      ctz,      TIE_FUNCTION1 | TIE_FLAG_PURE, 0},
+    {"if",       iffunc,   TIE_FUNCTION3 | TIE_FLAG_PURE, 0},
+    {"max",      max,      TIE_FUNCTION2 | TIE_FLAG_PURE, 0},
+    {"min",      min,      TIE_FUNCTION2 | TIE_FLAG_PURE, 0},
+    {"popcount", popcount, TIE_FUNCTION1 | TIE_FLAG_PURE, 0},
+    {"rotl",     rotl,     TIE_FUNCTION2 | TIE_FLAG_PURE, 0},
+    {"rotr",     rotr,     TIE_FUNCTION2 | TIE_FLAG_PURE, 0},
+    {0,          0,        0,                             0}
 };
 
 static const tie_variable *find_builtin(const char *name, int len) {
@@ -144,6 +393,15 @@ static const tie_variable *find_builtin(const char *name, int len) {
   return 0;
 }
 
+static int find_let(const state *s, const char *name, int len) {
+  /* Returns the slot of the innermost binding of name, or -1. */
+  int i;
+  for (i = s->let_depth - 1; i >= 0; --i) {
+    if (s->lets[i].len == len && strncmp(s->lets[i].name, name, len) == 0) return s->lets[i].slot;
+  }
+  return -1;
+}
+
 static const tie_variable *find_lookup(const state *s, const char *name, int len) {
   int iters;
   const tie_variable *var;
@@ -174,6 +432,10 @@ static int divide(int a, int b) {
   return a / b;
 }
 
+static int modulus(int a, int b) {
+  return a % b;
+}
+
 static int negate(int a) {
   return -a;
 }
@@ -207,8 +469,151 @@ static int bitwise_xor(int a, int b) {
   return a ^ b;
 }
 
+static int less(int a, int b) {
+  return a < b;
+}
+
+static int less_equal(int a, int b) {
+  return a <= b;
+}
+
+static int greater(int a, int b) {
+  return a > b;
+}
+
+static int greater_equal(int a, int b) {
+  return a >= b;
+}
+
+static int equal(int a, int b) {
+  return a == b;
+}
+
+static int not_equal(int a, int b) {
+  return a != b;
+}
+
+static const struct {
+  const void *function;
+  const char *symbol;
+} operators[] = {
+    {add,            "+"},
+    {sub,            "-"},
+    {mul,            "*"},
+    {divide,         "/"},
+    {modulus,        "%"},
+    {negate,         "-"},
+    {compliment,     "~"},
+    {comma,          ","},
+    {bitshift_left,  "<<"},
+    {bitshift_right, ">>"},
+    {bitwise_and,    "&"},
+    {bitwise_or,     "|"},
+    {bitwise_xor,    "^"},
+    {less,           "<"},
+    {less_equal,     "<="},
+    {greater,        ">"},
+    {greater_equal,  ">="},
+    {equal,          "=="},
+    {not_equal,      "!="},
+    {0,              0}
+};
+
+
+/* Checked counterparts of the operators above. They always produce a defined
+ * result and OR the TIE_ERROR_* conditions they hit into *flags, so the
+ * common case costs no extra branches. */
+typedef int (*tie_checked1)(int, int *);
+typedef int (*tie_checked2)(int, int, int *);
+
+static int checked_add(int a, int b, int *flags) {
+  int r;
+  *flags |= __builtin_add_overflow(a, b, &r) * TIE_ERROR_OVERFLOW;
+  return r;
+}
+
+static int checked_sub(int a, int b, int *flags) {
+  int r;
+  *flags |= __builtin_sub_overflow(a, b, &r) * TIE_ERROR_OVERFLOW;
+  return r;
+}
+
+static int checked_mul(int a, int b, int *flags) {
+  int r;
+  *flags |= __builtin_mul_overflow(a, b, &r) * TIE_ERROR_OVERFLOW;
+  return r;
+}
+
+static int checked_divide(int a, int b, int *flags) {
+  /* x / 0 gives 0, INT_MIN / -1 wraps to INT_MIN. */
+  const int zero = (b == 0);
+  const int wrap = (a == INT_MIN) & (b == -1);
+  *flags |= zero * TIE_ERROR_DIVIDE | wrap * TIE_ERROR_OVERFLOW;
+  return (a / ((zero | wrap) ? 1 : b)) & -!zero;
+}
+
+static int checked_modulus(int a, int b, int *flags) {
+  /* x % 0 gives 0, INT_MIN % -1 is 0 as it should be. */
+  const int zero = (b == 0);
+  *flags |= zero * TIE_ERROR_DIVIDE;
+  return a % ((zero | (b == -1)) ? 1 : b);
+}
+
+static int checked_negate(int a, int *flags) {
+  int r;
+  *flags |= __builtin_sub_overflow(0, a, &r) * TIE_ERROR_OVERFLOW;
+  return r;
+}
+
+static int checked_abs(int a, int *flags) {
+  *flags |= (a == INT_MIN) * TIE_ERROR_OVERFLOW;
+  return absfunc(a);
+}
+
+static int checked_bitshift_left(int a, int b, int *flags) {
+  const int s = b & 31;
+  const int r = (int) ((unsigned) a << s);
+  *flags |= ((unsigned) b > 31) * TIE_ERROR_SHIFT | ((r >> s) != a) * TIE_ERROR_OVERFLOW;
+  return r;
+}
+
+static int checked_bitshift_right(int a, int b, int *flags) {
+  *flags |= ((unsigned) b > 31) * TIE_ERROR_SHIFT;
+  return a >> (b & 31);
+}
+
+static const struct {
+  const void *function;
+  const void *checked;
+} checked_functions[] = {
+    {add,            checked_add},
+    {sub,            checked_sub},
+    {mul,            checked_mul},
+    {divide,         checked_divide},
+    {modulus,        checked_modulus},
+    {negate,         checked_negate},
+    {absfunc,        checked_abs},
+    {bitshift_left,  checked_bitshift_left},
+    {bitshift_right, checked_bitshift_right},
+    {0,              0}
+};
+
+static const void *find_checked(const void *function) {
+  int i;
+  for (i = 0; checked_functions[i].function; ++i) {
+    if (checked_functions[i].function == function) return checked_functions[i].checked;
+  }
+  return 0;
+}
+
 
 void next_token(state *s) {
+  if (s->limits.max_tokens && ++s->tokens > s->limits.max_tokens) {
+    s->over_limit = 1;
+    s->type = ERROR_TOKEN;
+    return;
+  }
+
   // Start off as a Null Token
   s->type = NULL_TOKEN;
 
@@ -233,14 +638,34 @@ void next_token(state *s) {
         const tie_variable *var = find_lookup(s, start, s->next - start);
         // If the variable couldn't be looked up, check to see if it's a builtin function
         if (!var) var = find_builtin(start, s->next - start);
-        // If the variable _STILL_ doesn't exist, then it's an error.
-        if (!var) {
+        const int let = find_let(s, start, s->next - start);
+        const char *after = s->next;
+        while (*after == ' ' || *after == '\t' || *after == '\n' || *after == '\r') after++;
+
+        if (after[0] == '=' && after[1] != '=') {
+          // An assignment binds a new name, or an output variable.
+          if (!var || (TYPE_MASK(var->type) == TIE_VARIABLE && (var->type & TIE_FLAG_OUTPUT) && !var->storage)) {
+            s->type = LET_TOKEN;
+            s->bound = var ? var->address : 0;
+            s->let_name = start;
+            s->let_len = s->next - start;
+            s->next = after + 1;
+          } else {
+            s->type = ERROR_TOKEN;
+          }
+        } else if (let >= 0) {
+          s->type = TEMP_TOKEN;
+          s->value = let;
+        } else if (!var) {
+          // If the variable _STILL_ doesn't exist, then it's an error.
           s->type = ERROR_TOKEN;
         } else {
           switch (TYPE_MASK(var->type)) {
             case TIE_VARIABLE:
               s->type = VARIABLE_TOKEN;
               s->bound = var->address;
+              s->range = var->range;
+              s->storage = var->storage;
               break;
 
             case TIE_CLOSURE0:
@@ -261,8 +686,11 @@ void next_token(state *s) {
             case TIE_FUNCTION5:
             case TIE_FUNCTION6:
             case TIE_FUNCTION7:
-              s->type = var->type;
+              s->type = var->type | (var->batch ? TIE_FLAG_BATCH : 0);
+              /* A memo has nothing to key on without arguments, and cannot live in an arena. */
+              if (s->arena || ARITY(s->type) == 0) s->type &= ~TIE_FLAG_MEMO;
               s->function = var->address;
+              s->batch = var->batch;
               break;
           }
         }
@@ -288,11 +716,37 @@ void next_token(state *s) {
             break;
           case '>':
             s->type = INFIX_TOKEN;
-            s->function = bitshift_right;
+            if (s->next[0] == '>') {
+              s->function = bitshift_right;
+              s->next++;
+            } else if (s->next[0] == '=') {
+              s->function = greater_equal;
+              s->next++;
+            } else {
+              s->function = greater;
+            }
             break;
           case '<':
             s->type = INFIX_TOKEN;
-            s->function = bitshift_left;
+            if (s->next[0] == '<') {
+              s->function = bitshift_left;
+              s->next++;
+            } else if (s->next[0] == '=') {
+              s->function = less_equal;
+              s->next++;
+            } else {
+              s->function = less;
+            }
+            break;
+          case '=':
+          case '!':
+            if (s->next[0] == '=') {
+              s->type = INFIX_TOKEN;
+              s->function = s->next[-1] == '=' ? equal : not_equal;
+              s->next++;
+            } else {
+              s->type = ERROR_TOKEN;
+            }
             break;
           case '+':
             s->type = INFIX_TOKEN;
@@ -312,7 +766,7 @@ void next_token(state *s) {
             break;
           case '%':
             s->type = INFIX_TOKEN;
-            s->function = fmod;
+            s->function = modulus;
             break;
           case '(':
             s->type = OPEN_TOKEN;
@@ -348,14 +802,30 @@ static tie_expression *bitwise(state *s);
 
 static tie_expression *shift(state *s);
 
+static void discard(state *s, tie_expression *n) {
+  /* Frees a tree the parser gave up on. Arena trees go away with the arena. */
+  if (!s->arena) tie_free(n);
+}
+
 static tie_expression *base(state *s) {
-  /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <unary> | <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
+  /* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <unary> | <function-X> "(" <bitwise> {"," <bitwise>} ")" | "(" <list> ")" */
   tie_expression *ret;
   unsigned char arity;
 
+  /* A name bound by a binding. Token numbers past 31 do not survive TYPE_MASK. */
+  if (s->type == TEMP_TOKEN) {
+    ret = new_expr(s, TIE_CLOSURE0 | TIE_FLAG_LET, 0);
+    CHECK_NULL(ret);
+
+    ret->function = let_read;
+    ret->parameters[0] = (void *) (size_t) s->value;
+    next_token(s);
+    return ret;
+  }
+
   switch (TYPE_MASK(s->type)) {
     case NUMBER_TOKEN:
-      ret = new_expr(TIE_CONSTANT, 0);
+      ret = new_expr(s, TIE_CONSTANT, 0);
       CHECK_NULL(ret);
 
       ret->value = s->value;
@@ -363,22 +833,24 @@ static tie_expression *base(state *s) {
       break;
 
     case VARIABLE_TOKEN:
-      ret = new_expr(TIE_VARIABLE, 0);
+      ret = new_expr(s, (s->range ? TIE_VARIABLE | TIE_FLAG_RANGE : TIE_VARIABLE) | s->storage << STORAGE_SHIFT, 0);
       CHECK_NULL(ret);
 
       ret->bound = s->bound;
+      if (s->range) ret->parameters[0] = (void *) s->range;
       next_token(s);
       break;
 
     case TIE_FUNCTION0:
     case TIE_CLOSURE0:
-      ret = new_expr(s->type, 0);
+      ret = new_expr(s, s->type, 0);
       CHECK_NULL(ret);
 
       ret->function = s->function;
       if (IS_CLOSURE(s->type)) {
         ret->parameters[0] = s->context;
       }
+      if (s->type & TIE_FLAG_BATCH) ret->parameters[BATCH_SLOT(s->type)] = (void *) s->batch;
       next_token(s);
       if (s->type == OPEN_TOKEN) {
         next_token(s);
@@ -392,7 +864,7 @@ static tie_expression *base(state *s) {
 
     case TIE_FUNCTION1:
     case TIE_CLOSURE1:
-      ret = new_expr(s->type, 0);
+      ret = new_expr(s, s->type, 0);
       CHECK_NULL(ret);
 
       ret->function = s->function;
@@ -401,10 +873,12 @@ static tie_expression *base(state *s) {
       if (IS_CLOSURE(s->type)) {
         ret->parameters[1] = s->context;
       }
+      if (s->type & TIE_FLAG_BATCH) ret->parameters[BATCH_SLOT(s->type)] = (void *) s->batch;
 #pragma clang diagnostic pop
+      attach_memo(ret);
       next_token(s);
       ret->parameters[0] = unary(s);
-      CHECK_NULL(ret->parameters[0], tie_free(ret));
+      CHECK_NULL(ret->parameters[0], discard(s, ret));
       break;
 
     case TIE_FUNCTION2:
@@ -421,11 +895,13 @@ static tie_expression *base(state *s) {
     case TIE_CLOSURE7:
       arity = ARITY(s->type);
 
-      ret = new_expr(s->type, 0);
+      ret = new_expr(s, s->type, 0);
       CHECK_NULL(ret);
 
       ret->function = s->function;
       if (IS_CLOSURE(s->type)) ret->parameters[arity] = s->context;
+      if (s->type & TIE_FLAG_BATCH) ret->parameters[BATCH_SLOT(s->type)] = (void *) s->batch;
+      attach_memo(ret);
       next_token(s);
 
       if (s->type != OPEN_TOKEN) {
@@ -434,8 +910,8 @@ static tie_expression *base(state *s) {
         unsigned char i;
         for (i = 0; i < arity; i++) {
           next_token(s);
-          ret->parameters[i] = expr(s);
-          CHECK_NULL(ret->parameters[i], tie_free(ret));
+          ret->parameters[i] = bitwise(s);
+          CHECK_NULL(ret->parameters[i], discard(s, ret));
 
           if (s->type != SEPARATOR_TOKEN) {
             break;
@@ -463,7 +939,7 @@ static tie_expression *base(state *s) {
       break;
 
     default:
-      ret = new_expr(0, 0);
+      ret = new_expr(s, 0, 0);
       CHECK_NULL(ret);
 
       s->type = ERROR_TOKEN;
@@ -477,6 +953,12 @@ static tie_expression *base(state *s) {
 
 static tie_expression *unary(state *s) {
   /* <unary> = {("-" | "+")} <base> */
+  /* Every level of nesting goes through here, so this is where depth is limited. */
+  if (s->limits.max_depth && ++s->depth > s->limits.max_depth) {
+    s->over_limit = 1;
+    return NULL;
+  }
+
   char sign = 1;
   while (s->type == INFIX_TOKEN && (s->function == add || s->function == sub)) {
     if (s->function == sub) sign = -sign;
@@ -491,12 +973,13 @@ static tie_expression *unary(state *s) {
     tie_expression *b = base(s);
     CHECK_NULL(b);
 
-    ret = NEW_EXPR(TIE_FUNCTION1 | TIE_FLAG_PURE, b);
-    CHECK_NULL(ret, tie_free(b));
+    ret = NEW_EXPR(s, TIE_FUNCTION1 | TIE_FLAG_PURE, b);
+    CHECK_NULL(ret, discard(s, b));
 
     ret->function = negate;
   }
 
+  --s->depth;
   return ret;
 }
 
@@ -505,15 +988,15 @@ static tie_expression *term(state *s) {
   tie_expression *ret = unary(s);
   CHECK_NULL(ret);
 
-  while (s->type == INFIX_TOKEN && (s->function == mul || s->function == divide || s->function == fmod)) {
+  while (s->type == INFIX_TOKEN && (s->function == mul || s->function == divide || s->function == modulus)) {
     tie_fun2 t = s->function;
     next_token(s);
     tie_expression *f = unary(s);
-    CHECK_NULL(f, tie_free(ret));
+    CHECK_NULL(f, discard(s, ret));
 
     tie_expression *prev = ret;
-    ret = NEW_EXPR(TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
-    CHECK_NULL(ret, tie_free(f), tie_free(prev));
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
+    CHECK_NULL(ret, discard(s, f), discard(s, prev));
 
     ret->function = t;
   }
@@ -531,11 +1014,11 @@ static tie_expression *expr(state *s) {
     tie_fun2 t = s->function;
     next_token(s);
     tie_expression *te = term(s);
-    CHECK_NULL(te, tie_free(ret));
+    CHECK_NULL(te, discard(s, ret));
 
     tie_expression *prev = ret;
-    ret = NEW_EXPR(TIE_FUNCTION2 | TIE_FLAG_PURE, ret, te);
-    CHECK_NULL(ret, tie_free(te), tie_free(prev));
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, te);
+    CHECK_NULL(ret, discard(s, te), discard(s, prev));
 
     ret->function = t;
   }
@@ -544,7 +1027,7 @@ static tie_expression *expr(state *s) {
 }
 
 static tie_expression *shift(state *s) {
-  // <shift> = <expr> {("<" | ">") <expr>}
+  // <shift> = <expr> {("<<" | ">>") <expr>}
   tie_expression *ret = expr(s);
   CHECK_NULL(ret);
 
@@ -552,11 +1035,11 @@ static tie_expression *shift(state *s) {
     tie_fun2 t = s->function;
     next_token(s);
     tie_expression *f = expr(s);
-    CHECK_NULL(f, tie_free(ret));
+    CHECK_NULL(f, discard(s, ret));
 
     tie_expression *prev = ret;
-    ret = NEW_EXPR(TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
-    CHECK_NULL(ret, tie_free(f), tie_free(prev));
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
+    CHECK_NULL(ret, discard(s, f), discard(s, prev));
 
     ret->function = t;
   }
@@ -564,20 +1047,62 @@ static tie_expression *shift(state *s) {
   return ret;
 }
 
-static tie_expression *bitwise(state *s) {
-  // <bitwise> = <shift> {("&" | "^" | "|" ) <shift>}
+static tie_expression *compare(state *s) {
+  // <compare> = <shift> {("<" | ">" | "<=" | ">=") <shift>}
   tie_expression *ret = shift(s);
   CHECK_NULL(ret);
 
-  while (s->type == INFIX_TOKEN && (s->function == bitwise_and || s->function == bitwise_xor || s->function == bitwise_or)) {
+  while (s->type == INFIX_TOKEN && (s->function == less || s->function == greater || s->function == less_equal || s->function == greater_equal)) {
     tie_fun2 t = s->function;
     next_token(s);
     tie_expression *f = shift(s);
-    CHECK_NULL(f, tie_free(ret));
+    CHECK_NULL(f, discard(s, ret));
+
+    tie_expression *prev = ret;
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
+    CHECK_NULL(ret, discard(s, f), discard(s, prev));
+
+    ret->function = t;
+  }
+
+  return ret;
+}
+
+static tie_expression *equality(state *s) {
+  // <equality> = <compare> {("==" | "!=") <compare>}
+  tie_expression *ret = compare(s);
+  CHECK_NULL(ret);
+
+  while (s->type == INFIX_TOKEN && (s->function == equal || s->function == not_equal)) {
+    tie_fun2 t = s->function;
+    next_token(s);
+    tie_expression *f = compare(s);
+    CHECK_NULL(f, discard(s, ret));
+
+    tie_expression *prev = ret;
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
+    CHECK_NULL(ret, discard(s, f), discard(s, prev));
+
+    ret->function = t;
+  }
+
+  return ret;
+}
+
+static tie_expression *bitwise(state *s) {
+  // <bitwise> = <equality> {("&" | "^" | "|" ) <equality>}
+  tie_expression *ret = equality(s);
+  CHECK_NULL(ret);
+
+  while (s->type == INFIX_TOKEN && (s->function == bitwise_and || s->function == bitwise_xor || s->function == bitwise_or)) {
+    tie_fun2 t = s->function;
+    next_token(s);
+    tie_expression *f = equality(s);
+    CHECK_NULL(f, discard(s, ret));
 
     tie_expression *prev = ret;
-    ret = NEW_EXPR(TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
-    CHECK_NULL(ret, tie_free(f), tie_free(prev));
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, f);
+    CHECK_NULL(ret, discard(s, f), discard(s, prev));
 
     ret->function = t;
   }
@@ -585,19 +1110,70 @@ static tie_expression *bitwise(state *s) {
   return ret;
 }
 
+static tie_expression *binding(state *s) {
+  /* <binding> = <name> "=" <bitwise> ["," <list>] */
+  /* The name is bound for the rest of the list, which gives the result. Without one, the value does. */
+  const char *name = s->let_name;
+  const int len = s->let_len;
+  const int *output = s->bound;
+  const int slot = s->let_count;
+
+  next_token(s);
+  tie_expression *value = bitwise(s);
+  CHECK_NULL(value);
+
+  if (output) {
+    tie_expression *store = NEW_EXPR(s, TIE_CLOSURE1 | TIE_FLAG_LET, value);
+    CHECK_NULL(store, discard(s, value));
+    store->function = let_output;
+    store->parameters[1] = (void *) output;
+    value = store;
+  }
+
+  if (slot == MAX_LETS) {
+    s->type = ERROR_TOKEN;
+    return value;
+  }
+  s->lets[s->let_depth].name = name;
+  s->lets[s->let_depth].len = len;
+  s->lets[s->let_depth].slot = slot;
+  s->let_depth++;
+  s->let_count++;
+
+  tie_expression *body;
+  if (s->type == SEPARATOR_TOKEN) {
+    next_token(s);
+    body = list(s);
+  } else {
+    body = new_expr(s, TIE_CLOSURE0 | TIE_FLAG_LET, 0);
+    if (body) {
+      body->function = let_read;
+      body->parameters[0] = (void *) (size_t) slot;
+    }
+  }
+  s->let_depth--;
+  CHECK_NULL(body, discard(s, value));
+
+  tie_expression *ret = NEW_EXPR(s, TIE_CLOSURE2 | TIE_FLAG_LET, value, body);
+  CHECK_NULL(ret, discard(s, value), discard(s, body));
+  ret->function = let_bind;
+  ret->parameters[2] = (void *) (size_t) slot;
+  return ret;
+}
+
 static tie_expression *list(state *s) {
-  /* <list> = <bitwise> {"," <bitwise>} */
-  tie_expression *ret = bitwise(s);
+  /* <list> = (<binding> | <bitwise>) {"," (<binding> | <bitwise>)} */
+  tie_expression *ret = s->type == LET_TOKEN ? binding(s) : bitwise(s);
   CHECK_NULL(ret);
 
   while (s->type == SEPARATOR_TOKEN) {
     next_token(s);
-    tie_expression *e = bitwise(s);
-    CHECK_NULL(e, tie_free(ret));
+    tie_expression *e = s->type == LET_TOKEN ? binding(s) : bitwise(s);
+    CHECK_NULL(e, discard(s, ret));
 
     tie_expression *prev = ret;
-    ret = NEW_EXPR(TIE_FUNCTION2 | TIE_FLAG_PURE, ret, e);
-    CHECK_NULL(ret, tie_free(e), tie_free(prev));
+    ret = NEW_EXPR(s, TIE_FUNCTION2 | TIE_FLAG_PURE, ret, e);
+    CHECK_NULL(ret, discard(s, e), discard(s, prev));
 
     ret->function = comma;
   }
@@ -607,17 +1183,31 @@ static tie_expression *list(state *s) {
 
 
 #define TIE_FUN(...) ((int(*)(__VA_ARGS__))n->function)
-#define M(e) tie_eval(n->parameters[e])
-
+#define M(e) eval_node(n->parameters[e])
+
+static int eval_memo(const tie_expression *n);
+static int eval_node(const tie_expression *n);
+
+static int eval_let(const tie_expression *n) {
+  /* Binds the value for the body, then restores the outer binding of the slot in case this
+   * is an expression evaluated by a function called from another one. */
+  int *value = &let_values[(size_t) n->parameters[2]];
+  const int outer = *value;
+  *value = M(0);
+  const int ret = M(1);
+  *value = outer;
+  return ret;
+}
 
-int tie_eval(const tie_expression *n) {
+static int eval_node(const tie_expression *n) {
   if (!n) return NAN;
+  COUNT_NODE();
 
   switch (TYPE_MASK(n->type)) {
     case TIE_CONSTANT:
       return n->value;
     case TIE_VARIABLE:
-      return *n->bound;
+      return STORAGE(n->type) ? load_value(n->bound, STORAGE(n->type)) : *n->bound;
 
     case TIE_FUNCTION0:
     case TIE_FUNCTION1:
@@ -627,6 +1217,7 @@ int tie_eval(const tie_expression *n) {
     case TIE_FUNCTION5:
     case TIE_FUNCTION6:
     case TIE_FUNCTION7:
+      if (n->type & TIE_FLAG_MEMO) return eval_memo(n);
       switch (ARITY(n->type)) {
         case 0:
           return TIE_FUN(void)();
@@ -658,6 +1249,8 @@ int tie_eval(const tie_expression *n) {
     case TIE_CLOSURE7:
 #pragma clang diagnostic push
 #pragma ide diagnostic ignored "ArrayIndexOutOfBounds"
+      if ((n->type & TIE_FLAG_LET) && ARITY(n->type) == 2) return eval_let(n);
+      if (n->type & TIE_FLAG_MEMO) return eval_memo(n);
       switch (ARITY(n->type)) {
         case 0:
           return TIE_FUN(void*)(n->parameters[0]);
@@ -689,84 +1282,193 @@ int tie_eval(const tie_expression *n) {
 #undef TIE_FUN
 #undef M
 
-static void optimize(tie_expression *n) {
-  /* Evaluates as much as possible. */
-  if (n->type == TIE_CONSTANT || n->type == TIE_VARIABLE) return;
+int tie_eval(const tie_expression *n) {
+  COUNT_EVALUATION();
+  return eval_node(n);
+}
 
-  /* Only optimize out functions flagged as pure. */
-  if (IS_PURE(n->type)) {
-    const int arity = ARITY(n->type);
-    int known = 1;
-    for (int i = 0; i < arity; ++i) {
-      optimize(n->parameters[i]);
-      if (((tie_expression *) (n->parameters[i]))->type != TIE_CONSTANT) {
-        known = 0;
-      }
-    }
-    if (known) {
-      const int value = tie_eval(n);
-      tie_free_parameters(n);
-      n->type = TIE_CONSTANT;
-      n->value = value;
+
+#define TIE_FUN(...) ((int(*)(__VA_ARGS__))n->function)
+
+static int invoke(const tie_expression *n, const int *a) {
+  /* Calls the function or closure of n on already evaluated arguments. */
+  if (IS_CLOSURE(n->type)) {
+#pragma clang diagnostic push
+#pragma ide diagnostic ignored "ArrayIndexOutOfBounds"
+    switch (ARITY(n->type)) {
+      case 0:
+        return TIE_FUN(void*)(n->parameters[0]);
+      case 1:
+        return TIE_FUN(void*, int)(n->parameters[1], a[0]);
+      case 2:
+        return TIE_FUN(void*, int, int)(n->parameters[2], a[0], a[1]);
+      case 3:
+        return TIE_FUN(void*, int, int, int)(n->parameters[3], a[0], a[1], a[2]);
+      case 4:
+        return TIE_FUN(void*, int, int, int, int)(n->parameters[4], a[0], a[1], a[2], a[3]);
+      case 5:
+        return TIE_FUN(void*, int, int, int, int, int)(n->parameters[5], a[0], a[1], a[2], a[3], a[4]);
+      case 6:
+        return TIE_FUN(void*, int, int, int, int, int, int)(n->parameters[6], a[0], a[1], a[2], a[3], a[4], a[5]);
+      case 7:
+        return TIE_FUN(void*, int, int, int, int, int, int, int)(n->parameters[7], a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+#pragma clang diagnostic pop
+      default:
+        return 0;
     }
   }
+
+  switch (ARITY(n->type)) {
+    case 0:
+      return TIE_FUN(void)();
+    case 1:
+      return TIE_FUN(int)(a[0]);
+    case 2:
+      return TIE_FUN(int, int)(a[0], a[1]);
+    case 3:
+      return TIE_FUN(int, int, int)(a[0], a[1], a[2]);
+    case 4:
+      return TIE_FUN(int, int, int, int)(a[0], a[1], a[2], a[3]);
+    case 5:
+      return TIE_FUN(int, int, int, int, int)(a[0], a[1], a[2], a[3], a[4]);
+    case 6:
+      return TIE_FUN(int, int, int, int, int, int)(a[0], a[1], a[2], a[3], a[4], a[5]);
+    case 7:
+      return TIE_FUN(int, int, int, int, int, int, int)(a[0], a[1], a[2], a[3], a[4], a[5], a[6]);
+    default:
+      return 0;
+  }
 }
 
+#undef TIE_FUN
 
-tie_expression *tie_compile(const char *expression, const tie_variable *variables, int var_count, int *error) {
-  state s;
-  s.start = s.next = expression;
-  s.lookup = variables;
-  s.lookup_len = var_count;
 
-  next_token(&s);
-  tie_expression *root = list(&s);
-  if (root == NULL) {
-    if (error) *error = -1;
-    return NULL;
+/* Results of a TIE_FLAG_MEMO function, direct-mapped on a hash of the arguments. */
+/* Each entry is a sequence number, the result and the arguments. The sequence is */
+/* odd while an entry is being written; a reader that sees it change counts a miss. */
+#define MEMO_ENTRIES 256
+
+typedef struct memo {
+  unsigned long long hits, misses;
+  int refs; /* Copies of a node share its memo. */
+  unsigned entries[];
+} memo;
+
+static tie_expression *attach_memo(tie_expression *n) {
+  /* Gives n an empty memo, or drops TIE_FLAG_MEMO if there is no memory for one. */
+  if (n->type & TIE_FLAG_MEMO) {
+    const size_t size = sizeof(memo) + MEMO_ENTRIES * (ARITY(n->type) + 2) * sizeof(unsigned);
+    memo *m = calloc(1, size);
+    if (m) m->refs = 1;
+    else retype(n, n->type & ~TIE_FLAG_MEMO);
+    n->parameters[MEMO_SLOT(n->type)] = m;
   }
+  return n;
+}
 
-  if (s.type != END_TOKEN) {
-    tie_free(root);
-    if (error) {
-      *error = (s.next - s.start);
-      if (*error == 0) *error = 1;
+static void release_memo(void *m) {
+  if (__atomic_sub_fetch(&((memo *) m)->refs, 1, __ATOMIC_ACQ_REL) == 0) free(m);
+}
+
+static int memo_call(const tie_expression *n, const int *a) {
+  memo *m = n->parameters[MEMO_SLOT(n->type)];
+  const int arity = ARITY(n->type);
+  unsigned hash = 0;
+  int i, same, result;
+
+  for (i = 0; i < arity; ++i) hash = (hash ^ (unsigned) a[i]) * 0x9e3779b1u;
+  hash ^= hash >> 16;
+  hash *= 0x85ebca6bu;
+  hash ^= hash >> 13;
+  unsigned *e = m->entries + (hash & (MEMO_ENTRIES - 1)) * (arity + 2);
+
+  const unsigned seq = __atomic_load_n(&e[0], __ATOMIC_ACQUIRE);
+  if (seq && !(seq & 1)) {
+    result = (int) __atomic_load_n(&e[1], __ATOMIC_RELAXED);
+    for (i = 0, same = 1; i < arity; ++i) {
+      same &= __atomic_load_n(&e[2 + i], __ATOMIC_RELAXED) == (unsigned) a[i];
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (same && __atomic_load_n(&e[0], __ATOMIC_RELAXED) == seq) {
+      __atomic_fetch_add(&m->hits, 1, __ATOMIC_RELAXED);
+      return result;
     }
-    return 0;
-  } else {
-    optimize(root);
-    if (error) *error = 0;
-    return root;
   }
-}
 
-int tie_interp(const char *expression, int *error) {
-  tie_expression *n = tie_compile(expression, 0, 0, error);
-  if (n == NULL) {
-    return NAN;
+  __atomic_fetch_add(&m->misses, 1, __ATOMIC_RELAXED);
+  result = invoke(n, a);
+
+  /* Skip the update if another thread is writing the entry. */
+  unsigned expected = __atomic_load_n(&e[0], __ATOMIC_RELAXED);
+  if (!(expected & 1) && __atomic_compare_exchange_n(&e[0], &expected, expected + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    __atomic_store_n(&e[1], (unsigned) result, __ATOMIC_RELAXED);
+    for (i = 0; i < arity; ++i) __atomic_store_n(&e[2 + i], (unsigned) a[i], __ATOMIC_RELAXED);
+    __atomic_store_n(&e[0], expected + 2, __ATOMIC_RELEASE);
   }
+  return result;
+}
 
-  int ret;
-  if (n) {
-    ret = tie_eval(n);
-    tie_free(n);
-  } else {
-    ret = NAN;
+static int call_function(const tie_expression *n, const int *a) {
+  return (n->type & TIE_FLAG_MEMO) ? memo_call(n, a) : invoke(n, a);
+}
+
+static int eval_memo(const tie_expression *n) {
+  int a[7];
+  int i;
+  for (i = 0; i < ARITY(n->type); ++i) a[i] = eval_node(n->parameters[i]);
+  return memo_call(n, a);
+}
+
+
+static void add_memo_stats(const tie_expression *n, tie_memo_stats *stats) {
+  int i;
+  if (n->type & TIE_FLAG_MEMO) {
+    const memo *m = n->parameters[MEMO_SLOT(n->type)];
+    stats->hits += __atomic_load_n(&m->hits, __ATOMIC_RELAXED);
+    stats->misses += __atomic_load_n(&m->misses, __ATOMIC_RELAXED);
   }
-  return ret;
+  for (i = 0; i < ARITY(n->type); ++i) add_memo_stats(n->parameters[i], stats);
 }
 
-static void pn(const tie_expression *n, int depth) {
+void tie_memo_get_stats(const tie_expression *n, tie_memo_stats *stats) {
+  stats->hits = stats->misses = 0;
+  if (n) add_memo_stats(n, stats);
+}
+
+
+void tie_get_stats(tie_stats *stats) {
+  thread_stats sum;
+  const thread_stats *t;
+
+  pthread_mutex_lock(&stats_lock);
+  sum = exited_stats;
+  for (t = live_stats; t; t = t->next) add_stats(&sum, t);
+  pthread_mutex_unlock(&stats_lock);
+
+  stats->compiles = sum.compiles;
+  stats->compile_failures = sum.compile_failures;
+  stats->nodes_allocated = sum.nodes_allocated;
+  stats->bytes_live = sum.bytes_live;
+  stats->evaluations = sum.evaluations;
+  stats->nodes_evaluated = sum.nodes_evaluated;
+  stats->nodes_per_evaluation = sum.counted_evaluations ? (double) sum.nodes_evaluated / sum.counted_evaluations : 0;
+  stats->folded_nodes = sum.folded_nodes;
+  stats->cache_hits = sum.cache_hits;
+  stats->cache_misses = sum.cache_misses;
+}
+
+
+static int eval_checked(const tie_expression *n, int *flags) {
+  int a[7];
   int i, arity;
-  printf("%*s", depth, "");
+  COUNT_NODE();
 
   switch (TYPE_MASK(n->type)) {
     case TIE_CONSTANT:
-      printf("%d\n", n->value);
-      break;
+      return n->value;
     case TIE_VARIABLE:
-      printf("bound %p\n", n->bound);
-      break;
+      return STORAGE(n->type) ? load_value(n->bound, STORAGE(n->type)) : *n->bound;
 
     case TIE_FUNCTION0:
     case TIE_FUNCTION1:
@@ -785,21 +1487,2557 @@ static void pn(const tie_expression *n, int depth) {
     case TIE_CLOSURE6:
     case TIE_CLOSURE7:
       arity = ARITY(n->type);
-      printf("f%d", arity);
-      for (i = 0; i < arity; i++) {
-        printf(" %p", n->parameters[i]);
+      if ((n->type & TIE_FLAG_LET) && arity == 2) {
+        int *value = &let_values[(size_t) n->parameters[2]];
+        const int outer = *value;
+        *value = eval_checked(n->parameters[0], flags);
+        const int ret = eval_checked(n->parameters[1], flags);
+        *value = outer;
+        return ret;
       }
-      printf("\n");
-      for (i = 0; i < arity; i++) {
-        pn(n->parameters[i], depth + 1);
+      for (i = 0; i < arity; ++i) {
+        a[i] = eval_checked(n->parameters[i], flags);
       }
-      break;
+      if (IS_FUNCTION(n->type) && !(n->type & TIE_FLAG_SAFE) && (arity == 1 || arity == 2)) {
+        const void *checked = find_checked(n->function);
+        if (checked && arity == 1) return ((tie_checked1) checked)(a[0], flags);
+        if (checked) return ((tie_checked2) checked)(a[0], a[1], flags);
+      }
+      return call_function(n, a);
+
+    default:
+      *flags |= TIE_ERROR_INVALID;
+      return 0;
   }
 }
 
 
-void tie_print(const tie_expression *n) {
-  pn(n, 0);
+int tie_eval_checked(const tie_expression *n, int *error) {
+  int flags = 0;
+  if (n) COUNT_EVALUATION();
+  const int ret = n ? eval_checked(n, &flags) : 0;
+  if (error) *error = n ? flags : -1;
+  return ret;
+}
+
+
+/* Batch evaluation runs every node as a tight loop over a block of rows
+ * rather than as one recursive call per row. */
+#define BATCH_BLOCK 1024
+/* Copying and re-preparing a tree to hoist its uniform inputs costs about as much as
+ * evaluating it for a couple of hundred rows, so smaller batches are not hoisted. */
+#define HOIST_MIN_ROWS 256
+
+typedef struct batch {
+  const tie_column *columns;
+  const tie_field *fields; /* Variables taken from the records of tie_eval_records. */
+  const char *records;
+  size_t stride;
+  const int *rows; /* Row numbers to gather from the columns, 0 for consecutive rows. */
+  int first;
+  int count;
+  unsigned char *flags;
+  int *lets; /* One block per let slot. */
+} batch;
+
+static int batch_slots(const tie_expression *n) {
+  /* Parameter i of a node is kept in scratch slot i-1 while the later ones are evaluated.
+   * Batch functions get all their parameters in scratch so they never alias the output. */
+  const int arity = ARITY(n->type);
+  const int first = (n->type & TIE_FLAG_BATCH) ? 1 : 0;
+  int i, need = 0;
+  for (i = 0; i < arity; ++i) {
+    const int slots = i + first + batch_slots(n->parameters[i]);
+    if (slots > need) need = slots;
+  }
+  /* 16-bit subtrees keep their result in one more slot. */
+  return need + ((n->type & TIE_FLAG_NARROW) ? 1 : 0);
+}
+
+static int batch_lets(const tie_expression *n) {
+  /* Number of let slots the batch must keep a block for. */
+  int i, need = 0;
+  if ((n->type & TIE_FLAG_LET) && ARITY(n->type) == 2) need = (int) (size_t) n->parameters[2] + 1;
+  for (i = 0; i < ARITY(n->type); ++i) {
+    const int lets = batch_lets(n->parameters[i]);
+    if (lets > need) need = lets;
+  }
+  return need;
+}
+
+#define LOAD_ROWS(TYPE) do { \
+    if (b->rows) { for (i = 0; i < b->count; ++i) out[i] = (int) *(const TYPE *) (data + b->rows[b->first + i] * stride); } \
+    else { for (i = 0; i < b->count; ++i) out[i] = (int) *(const TYPE *) (data + (size_t) (b->first + i) * stride); } \
+  } while (0)
+
+static void load_rows(const char *data, size_t stride, int type, const batch *b, int *out) {
+  /* Strided loads of the block's rows, widened or narrowed to int like a cast. One loop per
+   * type so each is a plain (gather) loop the compiler can vectorize. */
+  int i;
+  switch (type) {
+    case TIE_INT8: LOAD_ROWS(signed char); break;
+    case TIE_UINT8: LOAD_ROWS(unsigned char); break;
+    case TIE_INT16: LOAD_ROWS(short); break;
+    case TIE_UINT16: LOAD_ROWS(unsigned short); break;
+    case TIE_UINT32: LOAD_ROWS(unsigned); break;
+    case TIE_INT64: LOAD_ROWS(long long); break;
+    default: LOAD_ROWS(int); break;
+  }
+}
+
+#undef LOAD_ROWS
+
+static const tie_field *find_field(const batch *b, const int *bound) {
+  const tie_field *f;
+  for (f = b->fields; f && f->bound; ++f) {
+    if (f->bound == bound) return f;
+  }
+  return 0;
+}
+
+static void batch_load(const int *bound, int storage, const batch *b, int *out) {
+  /* Columns hold values of the variable's own type. */
+  const tie_column *c;
+  int i;
+  const tie_field *f = find_field(b, bound);
+  if (f) {
+    load_rows(b->records + f->offset, b->stride, f->type, b, out);
+    return;
+  }
+  for (c = b->columns; c && c->bound; ++c) {
+    if (c->bound == bound) {
+      if (storage) {
+        load_rows(c->data, storage_size(storage), storage, b, out);
+      } else if (b->rows) {
+        for (i = 0; i < b->count; ++i) out[i] = ((const int *) c->data)[b->rows[b->first + i]];
+      } else {
+        memcpy(out, (const int *) c->data + b->first, b->count * sizeof(int));
+      }
+      return;
+    }
+  }
+  const int value = load_value(bound, storage);
+  for (i = 0; i < b->count; ++i) out[i] = value;
+}
+
+#define BATCH_LOOP(EXPR) do { for (i = 0; i < count; ++i) out[i] = (EXPR); } while (0)
+#define BATCH_BROADCAST(OP) do { for (i = 0; i < count; ++i) out[i] = out[i] OP k; } while (0)
+#define BATCH_CHECKED(EXPR) do { for (i = 0; i < count; ++i) { int f = 0; out[i] = (EXPR); flags[i] |= f; } } while (0)
+
+static int batch_builtin(const void *function, int *const *p, int count, unsigned char *flags) {
+  /* Runs a builtin operator over the block in place of p[0]. Returns 0 for other functions. */
+  int *out = p[0];
+  const int *b = p[1];
+  int i;
+
+  if (flags) {
+    if (function == add) BATCH_CHECKED(checked_add(out[i], b[i], &f));
+    else if (function == sub) BATCH_CHECKED(checked_sub(out[i], b[i], &f));
+    else if (function == mul) BATCH_CHECKED(checked_mul(out[i], b[i], &f));
+    else if (function == divide) BATCH_CHECKED(checked_divide(out[i], b[i], &f));
+    else if (function == modulus) BATCH_CHECKED(checked_modulus(out[i], b[i], &f));
+    else if (function == negate) BATCH_CHECKED(checked_negate(out[i], &f));
+    else if (function == absfunc) BATCH_CHECKED(checked_abs(out[i], &f));
+    else if (function == bitshift_left) BATCH_CHECKED(checked_bitshift_left(out[i], b[i], &f));
+    else if (function == bitshift_right) BATCH_CHECKED(checked_bitshift_right(out[i], b[i], &f));
+    else goto unchecked;
+    return 1;
+  }
+
+unchecked:
+  if (function == add) BATCH_LOOP(out[i] + b[i]);
+  else if (function == sub) BATCH_LOOP(out[i] - b[i]);
+  else if (function == mul) BATCH_LOOP(out[i] * b[i]);
+  else if (function == divide) BATCH_LOOP(out[i] / b[i]);
+  else if (function == modulus) BATCH_LOOP(out[i] % b[i]);
+  else if (function == negate) BATCH_LOOP(-out[i]);
+  else if (function == compliment) BATCH_LOOP(~out[i]);
+  else if (function == bitshift_left) BATCH_LOOP(out[i] << b[i]);
+  else if (function == bitshift_right) BATCH_LOOP(out[i] >> b[i]);
+  else if (function == bitwise_and) BATCH_LOOP(out[i] & b[i]);
+  else if (function == bitwise_or) BATCH_LOOP(out[i] | b[i]);
+  else if (function == bitwise_xor) BATCH_LOOP(out[i] ^ b[i]);
+  else if (function == less) BATCH_LOOP(out[i] < b[i]);
+  else if (function == less_equal) BATCH_LOOP(out[i] <= b[i]);
+  else if (function == greater) BATCH_LOOP(out[i] > b[i]);
+  else if (function == greater_equal) BATCH_LOOP(out[i] >= b[i]);
+  else if (function == equal) BATCH_LOOP(out[i] == b[i]);
+  else if (function == not_equal) BATCH_LOOP(out[i] != b[i]);
+  else if (function == comma) BATCH_LOOP(b[i]);
+  else if (function == iffunc) BATCH_LOOP(out[i] ? b[i] : p[2][i]);
+  else if (function == absfunc) BATCH_LOOP(absfunc(out[i]));
+  else if (function == bswap) BATCH_LOOP(bswap(out[i]));
+  else if (function == clamp) BATCH_LOOP(clamp(out[i], b[i], p[2][i]));
+  else if (function == clz) BATCH_LOOP(clz(out[i]));
+  else if (function == ctz) BATCH_LOOP(ctz(out[i]));
+  else if (function == max) BATCH_LOOP(max(out[i], b[i]));
+  else if (function == min) BATCH_LOOP(min(out[i], b[i]));
+  else if (function == popcount) BATCH_LOOP(popcount(out[i]));
+  else if (function == rotl) BATCH_LOOP(rotl(out[i], b[i]));
+  else if (function == rotr) BATCH_LOOP(rotr(out[i], b[i]));
+  else return 0;
+  return 1;
+}
+
+static int batch_broadcast(const void *function, int *out, int k, int count) {
+  /* Runs a builtin operator with the constant k as its second operand over the block
+   * in place of out, without materializing k. Returns 0 for other functions, so a
+   * count of 0 asks whether the function is supported. */
+  int i;
+  if (function == add) BATCH_BROADCAST(+);
+  else if (function == sub) BATCH_BROADCAST(-);
+  else if (function == mul) BATCH_BROADCAST(*);
+  else if (function == divide) BATCH_BROADCAST(/);
+  else if (function == modulus) BATCH_BROADCAST(%);
+  else if (function == bitshift_left) BATCH_BROADCAST(<<);
+  else if (function == bitshift_right) BATCH_BROADCAST(>>);
+  else if (function == bitwise_and) BATCH_BROADCAST(&);
+  else if (function == bitwise_or) BATCH_BROADCAST(|);
+  else if (function == bitwise_xor) BATCH_BROADCAST(^);
+  else if (function == less) BATCH_BROADCAST(<);
+  else if (function == less_equal) BATCH_BROADCAST(<=);
+  else if (function == greater) BATCH_BROADCAST(>);
+  else if (function == greater_equal) BATCH_BROADCAST(>=);
+  else if (function == equal) BATCH_BROADCAST(==);
+  else if (function == not_equal) BATCH_BROADCAST(!=);
+  else if (function == max) BATCH_LOOP(max(out[i], k));
+  else if (function == min) BATCH_LOOP(min(out[i], k));
+  else return 0;
+  return 1;
+}
+
+static int is_commutative(const void *f) {
+  return f == add || f == mul || f == bitwise_and || f == bitwise_or || f == bitwise_xor
+         || f == min || f == max || f == equal || f == not_equal;
+}
+
+#undef BATCH_LOOP
+#undef BATCH_CHECKED
+#undef BATCH_BROADCAST
+
+static void eval_block16(const tie_expression *n, const batch *b, short *out, int *scratch) {
+  /* Evaluates a TIE_FLAG_NARROW subtree in 16-bit lanes. Values are known to fit, so
+   * the results match the int evaluation. */
+  const int count = b->count;
+  const tie_column *c;
+  int i;
+
+  if (TYPE_MASK(n->type) == TIE_CONSTANT) {
+    for (i = 0; i < count; ++i) out[i] = (short) n->value;
+    return;
+  }
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) {
+    const tie_field *f = find_field(b, n->bound);
+    const int storage = STORAGE(n->type);
+    const tie_column *typed = 0;
+    for (c = b->columns; !f && storage && c && c->bound; ++c) {
+      if (c->bound == n->bound) typed = c;
+    }
+    if (f || typed) {
+      /* Through a small int buffer: this leaf has no scratch of its own. */
+      const char *data = f ? b->records + f->offset : typed->data;
+      const size_t stride = f ? b->stride : storage_size(storage);
+      int values[64];
+      batch part = *b;
+      for (part.first = b->first; part.first < b->first + count; part.first += 64) {
+        part.count = b->first + count - part.first < 64 ? b->first + count - part.first : 64;
+        load_rows(data, stride, f ? f->type : storage, &part, values);
+        for (i = 0; i < part.count; ++i) out[part.first - b->first + i] = (short) values[i];
+      }
+      return;
+    }
+    for (c = b->columns; c && c->bound; ++c) {
+      if (c->bound == n->bound) {
+        for (i = 0; i < count; ++i) out[i] = (short) ((const int *) c->data)[b->rows ? b->rows[b->first + i] : b->first + i];
+        return;
+      }
+    }
+    const short value = (short) load_value(n->bound, storage);
+    for (i = 0; i < count; ++i) out[i] = value;
+    return;
+  }
+
+  const void *f = n->function;
+  short *y = (short *) scratch;
+  eval_block16(n->parameters[0], b, out, scratch);
+  if (ARITY(n->type) == 2) eval_block16(n->parameters[1], b, y, scratch + BATCH_BLOCK);
+
+  if (f == add) for (i = 0; i < count; ++i) out[i] = (short) (out[i] + y[i]);
+  else if (f == sub) for (i = 0; i < count; ++i) out[i] = (short) (out[i] - y[i]);
+  else if (f == mul) for (i = 0; i < count; ++i) out[i] = (short) (out[i] * y[i]);
+  else if (f == bitwise_and) for (i = 0; i < count; ++i) out[i] = (short) (out[i] & y[i]);
+  else if (f == bitwise_or) for (i = 0; i < count; ++i) out[i] = (short) (out[i] | y[i]);
+  else if (f == bitwise_xor) for (i = 0; i < count; ++i) out[i] = (short) (out[i] ^ y[i]);
+  else if (f == less) for (i = 0; i < count; ++i) out[i] = out[i] < y[i];
+  else if (f == less_equal) for (i = 0; i < count; ++i) out[i] = out[i] <= y[i];
+  else if (f == greater) for (i = 0; i < count; ++i) out[i] = out[i] > y[i];
+  else if (f == greater_equal) for (i = 0; i < count; ++i) out[i] = out[i] >= y[i];
+  else if (f == equal) for (i = 0; i < count; ++i) out[i] = out[i] == y[i];
+  else if (f == not_equal) for (i = 0; i < count; ++i) out[i] = out[i] != y[i];
+  else if (f == min) for (i = 0; i < count; ++i) out[i] = out[i] < y[i] ? out[i] : y[i];
+  else if (f == max) for (i = 0; i < count; ++i) out[i] = out[i] > y[i] ? out[i] : y[i];
+  else if (f == negate) for (i = 0; i < count; ++i) out[i] = (short) -out[i];
+  else if (f == compliment) for (i = 0; i < count; ++i) out[i] = (short) ~out[i];
+}
+
+static void eval_block(const tie_expression *n, const batch *b, int *out, int *scratch) {
+  int *p[7] = {0};
+  int a[7];
+  int i, j, arity;
+
+  if (n->type & TIE_FLAG_NARROW) {
+    short *narrow = (short *) scratch;
+    eval_block16(n, b, narrow, scratch + BATCH_BLOCK);
+    for (i = 0; i < b->count; ++i) out[i] = narrow[i];
+    return;
+  }
+
+  switch (TYPE_MASK(n->type)) {
+    case TIE_CONSTANT:
+      for (i = 0; i < b->count; ++i) out[i] = n->value;
+      break;
+    case TIE_VARIABLE:
+      batch_load(n->bound, STORAGE(n->type), b, out);
+      break;
+
+    case TIE_FUNCTION0:
+    case TIE_FUNCTION1:
+    case TIE_FUNCTION2:
+    case TIE_FUNCTION3:
+    case TIE_FUNCTION4:
+    case TIE_FUNCTION5:
+    case TIE_FUNCTION6:
+    case TIE_FUNCTION7:
+    case TIE_CLOSURE0:
+    case TIE_CLOSURE1:
+    case TIE_CLOSURE2:
+    case TIE_CLOSURE3:
+    case TIE_CLOSURE4:
+    case TIE_CLOSURE5:
+    case TIE_CLOSURE6:
+    case TIE_CLOSURE7:
+      arity = ARITY(n->type);
+      if (n->type & TIE_FLAG_LET) {
+        /* Bound values are kept in their own blocks. Output variables are only assigned by tie_eval. */
+        if (arity == 0) {
+          memcpy(out, b->lets + BATCH_BLOCK * (size_t) n->parameters[0], b->count * sizeof(int));
+        } else if (arity == 1) {
+          eval_block(n->parameters[0], b, out, scratch);
+        } else {
+          eval_block(n->parameters[0], b, b->lets + BATCH_BLOCK * (size_t) n->parameters[2], scratch);
+          eval_block(n->parameters[1], b, out, scratch);
+        }
+        break;
+      }
+      if (n->type & TIE_FLAG_BATCH) {
+        for (j = 0; j < arity; ++j) {
+          p[j] = scratch + j * BATCH_BLOCK;
+          eval_block(n->parameters[j], b, p[j], scratch + (j + 1) * BATCH_BLOCK);
+        }
+        ((tie_batch_function) n->parameters[BATCH_SLOT(n->type)])(
+            IS_CLOSURE(n->type) ? n->parameters[arity] : 0, (const int *const *) p, out, b->count);
+        break;
+      }
+
+      if (arity == 2 && IS_FUNCTION(n->type) && (!b->flags || (n->type & TIE_FLAG_SAFE))) {
+        /* An operation with one constant operand runs against the scalar directly. */
+        const tie_expression *x = n->parameters[0], *k = n->parameters[1];
+        if (TYPE_MASK(x->type) == TIE_CONSTANT && TYPE_MASK(k->type) != TIE_CONSTANT && is_commutative(n->function)) {
+          k = x;
+          x = n->parameters[1];
+        }
+        if (TYPE_MASK(k->type) == TIE_CONSTANT && batch_broadcast(n->function, out, k->value, 0)) {
+          eval_block(x, b, out, scratch);
+          batch_broadcast(n->function, out, k->value, b->count);
+          break;
+        }
+      }
+
+      for (j = 0; j < arity; ++j) {
+        p[j] = j ? scratch + (j - 1) * BATCH_BLOCK : out;
+        eval_block(n->parameters[j], b, p[j], scratch + j * BATCH_BLOCK);
+      }
+      if (IS_FUNCTION(n->type)
+          && batch_builtin(n->function, p, b->count, (n->type & TIE_FLAG_SAFE) ? 0 : b->flags))
+        break;
+
+      for (i = 0; i < b->count; ++i) {
+        for (j = 0; j < arity; ++j) a[j] = p[j][i];
+        out[i] = call_function(n, a);
+      }
+      break;
+
+    default:
+      for (i = 0; i < b->count; ++i) out[i] = 0;
+      if (b->flags) for (i = 0; i < b->count; ++i) b->flags[i] |= TIE_ERROR_INVALID;
+      break;
+  }
+}
+
+static tie_expression *copy_expr(const tie_expression *n, const tie_variable *fixed, int fixed_count);
+
+static tie_expression *prepare(tie_expression *n);
+
+static int has_column(const batch *b, const int *bound) {
+  const tie_column *c;
+  for (c = b->columns; c && c->bound; ++c) {
+    if (c->bound == bound) return 1;
+  }
+  return find_field(b, bound) != 0;
+}
+
+static void uniform_variables(const tie_expression *n, const batch *b, tie_variable *found, int *count) {
+  int i;
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) {
+    if (has_column(b, n->bound)) return;
+    for (i = 0; i < *count; ++i) {
+      if (found[i].address == n->bound) return;
+    }
+    memset(&found[*count], 0, sizeof(tie_variable));
+    found[(*count)++].address = n->bound;
+    return;
+  }
+  for (i = 0; i < ARITY(n->type); ++i) uniform_variables(n->parameters[i], b, found, count);
+}
+
+static int count_nodes(const tie_expression *n) {
+  int i, count = 1;
+  for (i = 0; i < ARITY(n->type); ++i) count += count_nodes(n->parameters[i]);
+  return count;
+}
+
+static void count_rows(const tie_expression *n, int n_rows) {
+  /* Batches count as one evaluation per row. */
+  if (n_rows <= 0) return;
+  COUNT(evaluations, n_rows);
+  STAT_ADD(counted_evaluations, n_rows);
+  STAT_ADD(nodes_evaluated, (unsigned long long) n_rows * count_nodes(n));
+}
+
+static tie_expression *hoist(const tie_expression *n, const batch *b, int n_rows) {
+  /* Variables without a column hold the same value for every row of a batch. Returns a
+   * copy of n in which they are constants and the pure subtrees that only depend on them
+   * are folded, so they are worked out once rather than once per row. Returns 0 when
+   * there is nothing to hoist or too few rows to pay for the copy. */
+  if (n_rows < HOIST_MIN_ROWS) return 0;
+  tie_variable *uniform = malloc(sizeof(tie_variable) * count_nodes(n));
+  int count = 0;
+  if (!uniform) return 0;
+
+  uniform_variables(n, b, uniform, &count);
+  tie_expression *ret = count ? copy_expr(n, uniform, count) : 0;
+  free(uniform);
+  return ret ? prepare(ret) : 0;
+}
+
+static int eval_batch(const tie_expression *n, batch b, int n_rows, int *out,
+                      int checked, unsigned char *error_mask) {
+  /* b gives the columns or records to read; the rest of it is filled in here. */
+  unsigned char flags[BATCH_BLOCK];
+  int i, j, errors = 0;
+
+  if (!n) return -1;
+  /* Hoisting may simplify away operations that would have flagged errors. */
+  tie_expression *hoisted = checked ? 0 : hoist(n, &b, n_rows);
+  if (hoisted) n = hoisted;
+  count_rows(n, n_rows);
+
+  const int slots = batch_slots(n), lets = batch_lets(n);
+  int *scratch = slots + lets ? malloc(sizeof(int) * BATCH_BLOCK * (slots + lets)) : 0;
+  if (slots + lets && !scratch) {
+    tie_free(hoisted);
+    return -1;
+  }
+
+  b.rows = 0;
+  b.flags = checked ? flags : 0;
+  b.lets = lets ? scratch + BATCH_BLOCK * slots : 0;
+  for (b.first = 0; b.first < n_rows; b.first += BATCH_BLOCK) {
+    b.count = n_rows - b.first < BATCH_BLOCK ? n_rows - b.first : BATCH_BLOCK;
+    if (!checked) {
+      eval_block(n, &b, out + b.first, scratch);
+      continue;
+    }
+
+    memset(flags, 0, b.count);
+    eval_block(n, &b, out + b.first, scratch);
+    for (i = 0; i < b.count; i += 8) {
+      unsigned char bits = 0;
+      for (j = 0; j < 8 && i + j < b.count; ++j) {
+        errors |= flags[i + j];
+        bits |= (flags[i + j] != 0) << j;
+      }
+      if (error_mask) error_mask[(b.first + i) >> 3] = bits;
+    }
+  }
+
+  free(scratch);
+  tie_free(hoisted);
+  return errors;
+}
+
+
+static batch from_columns(const tie_column *columns) {
+  batch b;
+  memset(&b, 0, sizeof(b));
+  b.columns = columns;
+  return b;
+}
+
+
+int tie_eval_batch(const tie_expression *n, const tie_column *columns, int n_rows, int *out) {
+  return eval_batch(n, from_columns(columns), n_rows, out, 0, 0);
+}
+
+
+int tie_eval_batch_checked(const tie_expression *n, const tie_column *columns, int n_rows, int *out,
+                           unsigned char *error_mask) {
+  return eval_batch(n, from_columns(columns), n_rows, out, 1, error_mask);
+}
+
+
+int tie_eval_records(const tie_expression *n, const void *base, size_t stride, const tie_field *fields,
+                     int n_rows, int *out) {
+  batch b = from_columns(0);
+  b.fields = fields;
+  b.records = base;
+  b.stride = stride;
+  return eval_batch(n, b, n_rows, out, 0, 0);
+}
+
+
+long long tie_eval_reduce(const tie_expression *n, const tie_column *columns, int n_rows, int op) {
+  /* Each block is evaluated into scratch and folded straight away, so only one
+   * block of results is ever live. The folds are plain loops the compiler vectorizes. */
+  long long sum = 0;
+  int low = INT_MAX, high = INT_MIN;
+  int i, nonzero = 0;
+  batch b;
+
+  if (!n || op < TIE_REDUCE_SUM || op > TIE_REDUCE_ALL) return LLONG_MIN;
+  b = from_columns(columns);
+  tie_expression *hoisted = hoist(n, &b, n_rows);
+  if (hoisted) n = hoisted;
+  count_rows(n, n_rows);
+
+  const int slots = batch_slots(n), lets = batch_lets(n);
+  int *out = malloc(sizeof(int) * BATCH_BLOCK * (slots + lets + 1));
+  if (!out) {
+    tie_free(hoisted);
+    return LLONG_MIN;
+  }
+  int *scratch = out + BATCH_BLOCK;
+
+  b.rows = 0;
+  b.flags = 0;
+  b.lets = scratch + BATCH_BLOCK * slots;
+  for (b.first = 0; b.first < n_rows; b.first += BATCH_BLOCK) {
+    const int count = b.count = n_rows - b.first < BATCH_BLOCK ? n_rows - b.first : BATCH_BLOCK;
+    eval_block(n, &b, out, scratch);
+
+    if (op == TIE_REDUCE_SUM) {
+      long long s = 0;
+      for (i = 0; i < count; ++i) s += out[i];
+      sum += s;
+    } else if (op == TIE_REDUCE_MIN) {
+      int m = low;
+      for (i = 0; i < count; ++i) m = out[i] < m ? out[i] : m;
+      low = m;
+    } else if (op == TIE_REDUCE_MAX) {
+      int m = high;
+      for (i = 0; i < count; ++i) m = out[i] > m ? out[i] : m;
+      high = m;
+    } else {
+      int c = 0;
+      for (i = 0; i < count; ++i) c += out[i] != 0;
+      nonzero += c;
+      /* The answer for any/all can be known before the last block. */
+      if (op == TIE_REDUCE_ANY && nonzero) break;
+      if (op == TIE_REDUCE_ALL && nonzero != b.first + count) break;
+    }
+  }
+
+  free(out);
+  tie_free(hoisted);
+  switch (op) {
+    case TIE_REDUCE_SUM: return sum;
+    case TIE_REDUCE_MIN: return low;
+    case TIE_REDUCE_MAX: return high;
+    case TIE_REDUCE_COUNT: return nonzero;
+    case TIE_REDUCE_ANY: return nonzero != 0;
+    default: return b.first >= n_rows; /* No early exit: every row was non-zero. */
+  }
+}
+
+
+static int topk_worse(const int *val, const int *idx, int a, int b) {
+  /* Lower scores lose, and so do later rows among equal scores. */
+  return val[a] < val[b] || (val[a] == val[b] && idx[a] > idx[b]);
+}
+
+static void topk_sift(int *val, int *idx, int size, int i) {
+  /* Moves entry i down the heap, which keeps the worst entry at the root. */
+  for (;;) {
+    int worst = i, c = 2 * i + 1;
+    if (c < size && topk_worse(val, idx, c, worst)) worst = c;
+    if (c + 1 < size && topk_worse(val, idx, c + 1, worst)) worst = c + 1;
+    if (worst == i) return;
+    const int v = val[i], r = idx[i];
+    val[i] = val[worst];
+    idx[i] = idx[worst];
+    val[worst] = v;
+    idx[worst] = r;
+    i = worst;
+  }
+}
+
+int tie_eval_topk(const tie_expression *n, const tie_column *columns, int n_rows, int k, int *out_idx, int *out_val) {
+  /* The heap lives in out_idx and out_val. Once it is full, each block is first cut down
+   * to the rows that beat the current k-th score with a branch-free loop; later rows
+   * never win a tie, so only strictly greater scores can get in. */
+  int i, size = 0;
+  batch b;
+
+  if (!n || k < 0) return -1;
+  if (k > n_rows) k = n_rows;
+  if (k == 0) return 0;
+  b = from_columns(columns);
+  tie_expression *hoisted = hoist(n, &b, n_rows);
+  if (hoisted) n = hoisted;
+  count_rows(n, n_rows);
+
+  const int slots = batch_slots(n), lets = batch_lets(n);
+  int *out = malloc(sizeof(int) * BATCH_BLOCK * (slots + lets + 2));
+  if (!out) {
+    tie_free(hoisted);
+    return -1;
+  }
+  int *passed = out + BATCH_BLOCK;
+  int *scratch = passed + BATCH_BLOCK;
+
+  b.rows = 0;
+  b.flags = 0;
+  b.lets = scratch + BATCH_BLOCK * slots;
+  for (b.first = 0; b.first < n_rows; b.first += BATCH_BLOCK) {
+    const int count = b.count = n_rows - b.first < BATCH_BLOCK ? n_rows - b.first : BATCH_BLOCK;
+    eval_block(n, &b, out, scratch);
+
+    i = 0;
+    for (; i < count && size < k; ++i) {
+      out_val[size] = out[i];
+      out_idx[size] = b.first + i;
+      ++size;
+      if (size == k) {
+        int j;
+        for (j = k / 2 - 1; j >= 0; --j) topk_sift(out_val, out_idx, k, j);
+      }
+    }
+    if (i == count) continue;
+
+    const int threshold = out_val[0];
+    int c = 0;
+    for (; i < count; ++i) {
+      passed[c] = i;
+      c += out[i] > threshold;
+    }
+    for (i = 0; i < c; ++i) {
+      const int row = passed[i];
+      if (out[row] <= out_val[0]) continue;
+      out_val[0] = out[row];
+      out_idx[0] = b.first + row;
+      topk_sift(out_val, out_idx, k, 0);
+    }
+  }
+
+  /* Heapsort: the worst entry goes to the back each time, leaving the best first. */
+  for (size = k - 1; size > 0; --size) {
+    const int v = out_val[0], r = out_idx[0];
+    out_val[0] = out_val[size];
+    out_idx[0] = out_idx[size];
+    out_val[size] = v;
+    out_idx[size] = r;
+    topk_sift(out_val, out_idx, size, 0);
+  }
+
+  free(out);
+  tie_free(hoisted);
+  return k;
+}
+
+
+/* Groups of tie_group_aggregate live in open-addressing tables keyed by the integer key.
+ * Each thread fills its own table from the blocks it takes, and the tables are merged
+ * into the first one at the end. A slot with no rows is empty. */
+typedef struct group_slot {
+  long long value;
+  int key;
+  int rows;
+} group_slot;
+
+typedef struct group_table {
+  group_slot *slots;
+  unsigned mask;
+  int size;
+} group_table;
+
+typedef struct grouping {
+  const tie_expression *key;
+  const tie_expression *value;
+  const tie_column *columns;
+  int n_rows;
+  int op;
+  int next_block;
+  int failed;
+} grouping;
+
+typedef struct group_worker {
+  grouping *g;
+  group_table table;
+  pthread_t thread;
+} group_worker;
+
+static unsigned group_hash(int key) {
+  unsigned h = (unsigned) key * 0x9e3779b1u;
+  return h ^ (h >> 16);
+}
+
+static int group_grow(group_table *t) {
+  const unsigned capacity = t->slots ? (t->mask + 1) * 2 : 64;
+  group_slot *slots = calloc(capacity, sizeof(group_slot));
+  unsigned i;
+  if (!slots) return -1;
+
+  for (i = 0; t->slots && i <= t->mask; ++i) {
+    if (!t->slots[i].rows) continue;
+    unsigned at = group_hash(t->slots[i].key) & (capacity - 1);
+    while (slots[at].rows) at = (at + 1) & (capacity - 1);
+    slots[at] = t->slots[i];
+  }
+  free(t->slots);
+  t->slots = slots;
+  t->mask = capacity - 1;
+  return 0;
+}
+
+static group_slot *group_find(group_table *t, int key) {
+  /* Returns the slot of key, which has no rows yet if it is new. Keeps the table at most half full. */
+  if (!t->slots || (unsigned) (t->size + 1) * 2 > t->mask + 1) {
+    if (group_grow(t)) return 0;
+  }
+  unsigned at = group_hash(key) & t->mask;
+  while (t->slots[at].rows && t->slots[at].key != key) at = (at + 1) & t->mask;
+  if (!t->slots[at].rows) {
+    t->slots[at].key = key;
+    ++t->size;
+  }
+  return &t->slots[at];
+}
+
+static void group_add(group_slot *slot, int op, long long value, int rows) {
+  /* Folds value, the aggregate of rows rows, into the slot. */
+  if (!slot->rows) slot->value = value;
+  else if (op == TIE_REDUCE_MIN) slot->value = value < slot->value ? value : slot->value;
+  else if (op == TIE_REDUCE_MAX) slot->value = value > slot->value ? value : slot->value;
+  else slot->value += value;
+  slot->rows += rows;
+}
+
+static void *group_worker_run(void *arg) {
+  group_worker *w = arg;
+  grouping *g = w->g;
+  const int counted = g->op != TIE_REDUCE_SUM && g->op != TIE_REDUCE_MIN && g->op != TIE_REDUCE_MAX;
+  const int key_slots = batch_slots(g->key) + batch_lets(g->key);
+  const int value_slots = g->value ? batch_slots(g->value) + batch_lets(g->value) : 0;
+  int *keys = malloc(sizeof(int) * BATCH_BLOCK * (2 + key_slots + value_slots));
+  group_slot *slot = 0;
+  batch bk, bv;
+  int block, i;
+
+  if (!keys) {
+    __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+    return 0;
+  }
+  int *values = keys + BATCH_BLOCK;
+  int *key_scratch = values + BATCH_BLOCK;
+  int *value_scratch = key_scratch + BATCH_BLOCK * key_slots;
+
+  bk = bv = from_columns(g->columns);
+  bk.lets = key_scratch + BATCH_BLOCK * batch_slots(g->key);
+  if (g->value) bv.lets = value_scratch + BATCH_BLOCK * batch_slots(g->value);
+
+  while (!__atomic_load_n(&g->failed, __ATOMIC_RELAXED) &&
+         (block = __atomic_fetch_add(&g->next_block, 1, __ATOMIC_RELAXED)) < (g->n_rows + BATCH_BLOCK - 1) / BATCH_BLOCK) {
+    bk.first = bv.first = block * BATCH_BLOCK;
+    bk.count = bv.count = g->n_rows - bk.first < BATCH_BLOCK ? g->n_rows - bk.first : BATCH_BLOCK;
+    eval_block(g->key, &bk, keys, key_scratch);
+    if (g->value) eval_block(g->value, &bv, values, value_scratch);
+    else for (i = 0; i < bk.count; ++i) values[i] = 1;
+
+    for (i = 0; i < bk.count; ++i) {
+      /* Runs of one key skip the lookup. */
+      if (!slot || slot->key != keys[i]) {
+        slot = group_find(&w->table, keys[i]);
+        if (!slot) {
+          __atomic_store_n(&g->failed, 1, __ATOMIC_RELAXED);
+          break;
+        }
+      }
+      group_add(slot, g->op, counted ? values[i] != 0 : values[i], 1);
+    }
+    /* The table may move when it grows. */
+    slot = 0;
+  }
+
+  free(keys);
+  return 0;
+}
+
+static int compare_groups(const void *a, const void *b) {
+  const int x = ((const tie_group *) a)->key, y = ((const tie_group *) b)->key;
+  return (x > y) - (x < y);
+}
+
+int tie_group_aggregate(const tie_expression *key, const tie_expression *value, const tie_column *columns,
+                        int n_rows, int op, int threads, tie_group **groups) {
+  grouping g;
+  int i, started = 1;
+
+  *groups = 0;
+  if (!key || n_rows < 0 || op < TIE_REDUCE_SUM || op > TIE_REDUCE_ALL) return -1;
+  if (!value && op != TIE_REDUCE_COUNT) return -1;
+
+  /* Threads get at least 16 blocks each; smaller inputs are not worth starting them. */
+  const int blocks = (n_rows + BATCH_BLOCK - 1) / BATCH_BLOCK;
+  if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > blocks / 16) threads = blocks / 16;
+  if (threads < 1) threads = 1;
+  group_worker *workers = calloc(threads, sizeof(group_worker));
+  if (!workers) return -1;
+
+  batch b = from_columns(columns);
+  tie_expression *hoisted_key = hoist(key, &b, n_rows);
+  tie_expression *hoisted_value = value ? hoist(value, &b, n_rows) : 0;
+  g.key = hoisted_key ? hoisted_key : key;
+  g.value = hoisted_value ? hoisted_value : value;
+  g.columns = columns;
+  g.n_rows = n_rows;
+  g.op = op;
+  g.next_block = 0;
+  g.failed = 0;
+  count_rows(g.key, n_rows);
+  if (g.value) count_rows(g.value, n_rows);
+
+  /* The calling thread is worker 0 and keeps the merged table. */
+  for (i = 0; i < threads; ++i) workers[i].g = &g;
+  for (i = 1; i < threads; ++i) {
+    if (pthread_create(&workers[started].thread, 0, group_worker_run, &workers[started]) == 0) ++started;
+  }
+  group_worker_run(&workers[0]);
+  for (i = 1; i < started; ++i) pthread_join(workers[i].thread, 0);
+
+  group_table *table = &workers[0].table;
+  for (i = 1; i < started; ++i) {
+    const group_table *t = &workers[i].table;
+    unsigned j;
+    for (j = 0; t->slots && j <= t->mask && !g.failed; ++j) {
+      if (!t->slots[j].rows) continue;
+      group_slot *slot = group_find(table, t->slots[j].key);
+      if (slot) group_add(slot, op, t->slots[j].value, t->slots[j].rows);
+      else g.failed = 1;
+    }
+  }
+
+  int count = g.failed ? -1 : table->size;
+  if (count >= 0) {
+    *groups = malloc(sizeof(tie_group) * (count ? count : 1));
+    if (!*groups) count = -1;
+  }
+  if (count > 0) {
+    int k = 0;
+    unsigned j;
+    for (j = 0; j <= table->mask; ++j) {
+      const group_slot *slot = &table->slots[j];
+      if (!slot->rows) continue;
+      tie_group *out = &(*groups)[k++];
+      out->key = slot->key;
+      out->rows = slot->rows;
+      out->value = op == TIE_REDUCE_ANY ? slot->value != 0 : op == TIE_REDUCE_ALL ? slot->value == slot->rows : slot->value;
+    }
+    qsort(*groups, count, sizeof(tie_group), compare_groups);
+  }
+
+  for (i = 0; i < started; ++i) free(workers[i].table.slots);
+  free(workers);
+  tie_free(hoisted_key);
+  tie_free(hoisted_value);
+  return count;
+}
+
+
+static int eval_predicate(const tie_expression *n, const tie_column *columns, const int *rows, int n_rows,
+                          unsigned char *bitmap, int *selected) {
+  /* Evaluates n as a filter, writing matches to bitmap or selected. Returns the match count. */
+  int i, j, matches = 0;
+  batch b;
+
+  if (!n) return -1;
+  b = from_columns(columns);
+  tie_expression *hoisted = hoist(n, &b, n_rows);
+  if (hoisted) n = hoisted;
+  count_rows(n, n_rows);
+
+  const int slots = batch_slots(n), lets = batch_lets(n);
+  int *out = malloc(sizeof(int) * BATCH_BLOCK * (slots + lets + 1));
+  if (!out) {
+    tie_free(hoisted);
+    return -1;
+  }
+  int *scratch = out + BATCH_BLOCK;
+
+  b.rows = rows;
+  b.flags = 0;
+  b.lets = scratch + BATCH_BLOCK * slots;
+  for (b.first = 0; b.first < n_rows; b.first += BATCH_BLOCK) {
+    const int count = b.count = n_rows - b.first < BATCH_BLOCK ? n_rows - b.first : BATCH_BLOCK;
+    eval_block(n, &b, out, scratch);
+
+    if (bitmap) {
+      for (i = 0; i < count; i += 8) {
+        unsigned char bits = 0;
+        for (j = 0; j < 8 && i + j < count; ++j) bits |= (out[i + j] != 0) << j;
+        bitmap[(b.first + i) >> 3] = bits;
+      }
+    }
+    if (selected) {
+      /* Branch-free compaction; writing behind the read position lets selected alias rows. */
+      for (i = 0; i < count; ++i) {
+        selected[matches] = rows ? rows[b.first + i] : b.first + i;
+        matches += out[i] != 0;
+      }
+    } else {
+      for (i = 0; i < count; ++i) matches += out[i] != 0;
+    }
+  }
+
+  free(out);
+  tie_free(hoisted);
+  return matches;
+}
+
+
+int tie_eval_bitmap(const tie_expression *n, const tie_column *columns, int n_rows, unsigned char *bitmap) {
+  return eval_predicate(n, columns, 0, n_rows, bitmap, 0);
+}
+
+
+int tie_eval_select(const tie_expression *n, const tie_column *columns, const int *rows, int n_rows,
+                    int *selected) {
+  return eval_predicate(n, columns, rows, n_rows, 0, selected);
+}
+
+
+/* Value ranges are worked out in long long, so that results which leave the
+ * int range show up as possible overflows. */
+typedef struct span {
+  long long min;
+  long long max;
+} span;
+
+static const span full_span = {INT_MIN, INT_MAX};
+
+static span span2(long long a, long long b) {
+  span r;
+  r.min = a < b ? a : b;
+  r.max = a < b ? b : a;
+  return r;
+}
+
+static span span4(long long a, long long b, long long c, long long d) {
+  const span x = span2(a, b), y = span2(c, d);
+  return span2(x.min < y.min ? x.min : y.min, x.max > y.max ? x.max : y.max);
+}
+
+static int fits(span r, long long lo, long long hi) {
+  return r.min >= lo && r.max <= hi;
+}
+
+static long long low_bits(long long a) {
+  /* Smallest 2^k-1 that is at least a (a >= 0). */
+  long long m = 0;
+  while (m < a) m = m * 2 + 1;
+  return m;
+}
+
+static span truth(int always, int never) {
+  /* Range of a comparison that is always true, never true, or either. */
+  return span2(always, !never);
+}
+
+static span node_span(const tie_expression *n, const span *p, int *safe) {
+  /* Range of n given the ranges of its parameters. *safe is set when the operation
+   * can neither overflow nor trap. */
+  const void *f = n->function;
+  span r = full_span;
+  int fails = 0;
+
+  *safe = 0;
+  if (TYPE_MASK(n->type) == TIE_CONSTANT) return span2(n->value, n->value);
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) {
+    if (n->type & TIE_FLAG_RANGE) {
+      const tie_range *range = n->parameters[0];
+      return span2(range->min, range->max);
+    }
+    /* Narrow types bring their own range. */
+    switch (STORAGE(n->type)) {
+      case TIE_INT8: return span2(SCHAR_MIN, SCHAR_MAX);
+      case TIE_UINT8: return span2(0, UCHAR_MAX);
+      case TIE_INT16: return span2(SHRT_MIN, SHRT_MAX);
+      case TIE_UINT16: return span2(0, USHRT_MAX);
+    }
+    return r;
+  }
+  if (!IS_FUNCTION(n->type)) return r;
+
+  if (f == add) r = span2(p[0].min + p[1].min, p[0].max + p[1].max);
+  else if (f == sub) r = span2(p[0].min - p[1].max, p[0].max - p[1].min);
+  else if (f == mul) r = span4(p[0].min * p[1].min, p[0].min * p[1].max, p[0].max * p[1].min, p[0].max * p[1].max);
+  else if (f == negate) r = span2(-p[0].max, -p[0].min);
+  else if (f == compliment) r = span2(~p[0].max, ~p[0].min);
+  else if (f == comma) r = p[1];
+  else if (f == divide) {
+    if (p[1].min > 0 || p[1].max < 0) {
+      r = span4(p[0].min / p[1].min, p[0].min / p[1].max, p[0].max / p[1].min, p[0].max / p[1].max);
+    } else {
+      fails = 1;
+    }
+  } else if (f == modulus) {
+    const long long bound = (-p[1].min > p[1].max ? -p[1].min : p[1].max) - 1;
+    const long long m = bound > 0 ? bound : 0;
+    r = span2(p[0].min < -m ? -m : p[0].min < 0 ? p[0].min : 0, p[0].max > m ? m : p[0].max > 0 ? p[0].max : 0);
+    fails = (p[1].min <= 0 && p[1].max >= 0) || (p[0].min == INT_MIN && p[1].min <= -1 && p[1].max >= -1);
+  } else if (f == bitshift_left || f == bitshift_right) {
+    if (p[1].min >= 0 && p[1].max <= 31) {
+      if (f == bitshift_left) {
+        r = span4(p[0].min * (1LL << p[1].min), p[0].min * (1LL << p[1].max),
+                  p[0].max * (1LL << p[1].min), p[0].max * (1LL << p[1].max));
+      } else {
+        r = span4(p[0].min >> p[1].min, p[0].min >> p[1].max, p[0].max >> p[1].min, p[0].max >> p[1].max);
+      }
+    } else {
+      fails = 1;
+    }
+  } else if (f == bitwise_and) {
+    if (p[0].min >= 0 && p[1].min >= 0) r = span2(0, p[0].max < p[1].max ? p[0].max : p[1].max);
+    else if (p[0].min >= 0) r = span2(0, p[0].max);
+    else if (p[1].min >= 0) r = span2(0, p[1].max);
+  } else if (f == bitwise_or || f == bitwise_xor) {
+    if (p[0].min >= 0 && p[1].min >= 0) r = span2(0, low_bits(p[0].max > p[1].max ? p[0].max : p[1].max));
+  } else if (f == iffunc) {
+    if (p[0].min > 0 || p[0].max < 0) r = p[1];
+    else if (p[0].min == 0 && p[0].max == 0) r = p[2];
+    else r = span4(p[1].min, p[1].max, p[2].min, p[2].max);
+  } else if (f == absfunc) {
+    if (p[0].min >= 0) r = p[0];
+    else if (p[0].max <= 0) r = span2(-p[0].max, -p[0].min);
+    else r = span2(0, -p[0].min > p[0].max ? -p[0].min : p[0].max);
+  } else if (f == min) {
+    r = span2(p[0].min < p[1].min ? p[0].min : p[1].min, p[0].max < p[1].max ? p[0].max : p[1].max);
+  } else if (f == max) {
+    r = span2(p[0].min > p[1].min ? p[0].min : p[1].min, p[0].max > p[1].max ? p[0].max : p[1].max);
+  } else if (f == clamp) {
+    r = span2(p[1].min < p[2].min ? p[1].min : p[2].min, p[1].max > p[2].max ? p[1].max : p[2].max);
+  } else if (f == popcount || f == clz || f == ctz) {
+    r = span2(0, 32);
+  } else if (f == less) {
+    r = truth(p[0].max < p[1].min, p[0].min >= p[1].max);
+  } else if (f == less_equal) {
+    r = truth(p[0].max <= p[1].min, p[0].min > p[1].max);
+  } else if (f == greater) {
+    r = truth(p[0].min > p[1].max, p[0].max <= p[1].min);
+  } else if (f == greater_equal) {
+    r = truth(p[0].min >= p[1].max, p[0].max < p[1].min);
+  } else if (f == equal || f == not_equal) {
+    const int same = p[0].min == p[0].max && p[1].min == p[1].max && p[0].min == p[1].min;
+    const int apart = p[0].max < p[1].min || p[0].min > p[1].max;
+    r = f == equal ? truth(same, apart) : truth(apart, same);
+  }
+
+  if (!fits(r, INT_MIN, INT_MAX)) return full_span;
+  *safe = !fails;
+  return r;
+}
+
+static span range_of(const tie_expression *n) {
+  span p[7] = {{0, 0}};
+  int i, safe;
+  for (i = 0; i < ARITY(n->type); ++i) p[i] = range_of(n->parameters[i]);
+  return node_span(n, p, &safe);
+}
+
+static int is_compare(const void *f) {
+  return f == less || f == less_equal || f == greater || f == greater_equal || f == equal || f == not_equal;
+}
+
+static int is_narrow_op(const void *f) {
+  return f == add || f == sub || f == mul || f == negate || f == compliment
+         || f == bitwise_and || f == bitwise_or || f == bitwise_xor || f == min || f == max || is_compare(f);
+}
+
+static span annotate(tie_expression *n, int *narrow) {
+  /* Marks operations that cannot fail and subtrees that fit in 16 bits. */
+  const int arity = ARITY(n->type);
+  span p[7] = {{0, 0}};
+  int i, safe, all = 1;
+
+  n->type &= ~(TIE_FLAG_SAFE | TIE_FLAG_NARROW);
+  for (i = 0; i < arity; ++i) {
+    int child;
+    p[i] = annotate(n->parameters[i], &child);
+    all &= child;
+  }
+
+  const span r = node_span(n, p, &safe);
+  if (safe && arity) n->type |= TIE_FLAG_SAFE;
+
+  if (arity) {
+    *narrow = all && IS_FUNCTION(n->type) && is_narrow_op(n->function) && fits(r, SHRT_MIN, SHRT_MAX);
+    if (*narrow) n->type |= TIE_FLAG_NARROW;
+  } else {
+    *narrow = (TYPE_MASK(n->type) == TIE_CONSTANT || TYPE_MASK(n->type) == TIE_VARIABLE) && fits(r, SHRT_MIN, SHRT_MAX);
+  }
+  return r;
+}
+
+tie_range tie_get_range(const tie_expression *n) {
+  const span r = range_of(n);
+  tie_range ret;
+  ret.min = (int) r.min;
+  ret.max = (int) r.max;
+  return ret;
+}
+
+
+static int is_pure_tree(const tie_expression *n) {
+  int i;
+  if (ARITY(n->type) == 0) return TYPE_MASK(n->type) == TIE_CONSTANT || TYPE_MASK(n->type) == TIE_VARIABLE;
+  if (!IS_PURE(n->type)) return 0;
+  for (i = 0; i < ARITY(n->type); ++i) {
+    if (!is_pure_tree(n->parameters[i])) return 0;
+  }
+  return 1;
+}
+
+static span safe_span(const tie_expression *n, int *safe) {
+  /* Range of n. *safe is set when nothing in n can overflow or trap. */
+  span p[7] = {{0, 0}};
+  int i, child, all = 1;
+  for (i = 0; i < ARITY(n->type); ++i) {
+    p[i] = safe_span(n->parameters[i], &child);
+    all &= child;
+  }
+  const span r = node_span(n, p, safe);
+  *safe = ARITY(n->type) ? *safe && all : 1;
+  return r;
+}
+
+static int can_drop(const tie_expression *n) {
+  /* Whether n may be left unevaluated without losing a side effect or an error. */
+  int safe;
+  if (!is_pure_tree(n)) return 0;
+  safe_span(n, &safe);
+  return safe;
+}
+
+static tie_expression *simplify(tie_expression *n) {
+  /* Removes operations that have an identity or absorbing constant operand. */
+  if (!IS_FUNCTION(n->type) || ARITY(n->type) != 2) return n;
+
+  const void *f = n->function;
+  const tie_expression *a = n->parameters[0], *b = n->parameters[1];
+  const int a0 = TYPE_MASK(a->type) == TIE_CONSTANT && a->value == 0;
+  const int a1 = TYPE_MASK(a->type) == TIE_CONSTANT && a->value == 1;
+  const int b0 = TYPE_MASK(b->type) == TIE_CONSTANT && b->value == 0;
+  const int b1 = TYPE_MASK(b->type) == TIE_CONSTANT && b->value == 1;
+  int keep = -1;
+
+  if (b0 && (f == add || f == sub || f == bitwise_or || f == bitwise_xor || f == bitshift_left || f == bitshift_right)) keep = 0;
+  else if (a0 && (f == add || f == bitwise_or || f == bitwise_xor)) keep = 1;
+  else if (b1 && (f == mul || f == divide)) keep = 0;
+  else if (a1 && f == mul) keep = 1;
+  else if (b0 && (f == mul || f == bitwise_and) && can_drop(a)) keep = 1;
+  else if (a0 && (f == mul || f == bitwise_and) && can_drop(b)) keep = 0;
+  else if (f == comma && can_drop(a)) keep = 1;
+  if (keep < 0) return n;
+
+  tie_expression *ret = n->parameters[keep];
+  n->parameters[keep] = 0;
+  tie_free(n);
+  return ret;
+}
+
+static tie_expression *optimize(tie_expression *n) {
+  /* Evaluates as much as possible. Returns n or the node that replaced it. */
+  if (TYPE_MASK(n->type) == TIE_CONSTANT || TYPE_MASK(n->type) == TIE_VARIABLE) return n;
+
+  const int arity = ARITY(n->type);
+  int known = 1;
+  for (int i = 0; i < arity; ++i) {
+    n->parameters[i] = optimize(n->parameters[i]);
+    if (TYPE_MASK(((tie_expression *) (n->parameters[i]))->type) != TIE_CONSTANT) {
+      known = 0;
+    }
+  }
+
+  /* Only optimize out functions flagged as pure. */
+  if (!IS_PURE(n->type)) return n;
+
+  if (known) {
+    /* Leave operations that would trap or overflow to run time. */
+    int flags = 0;
+    const int value = eval_checked(n, &flags);
+    if (!flags) {
+      tie_free_parameters(n);
+      retype(n, TIE_CONSTANT);
+      n->value = value;
+      COUNT(folded_nodes, 1);
+    }
+    return n;
+  }
+
+  n = simplify(n);
+
+  /* The variable ranges may decide a comparison. */
+  if (IS_FUNCTION(n->type) && is_compare(n->function) && can_drop(n)) {
+    const span r = range_of(n);
+    if (r.min == r.max) {
+      tie_free_parameters(n);
+      retype(n, TIE_CONSTANT);
+      n->value = (int) r.min;
+      COUNT(folded_nodes, 1);
+      return n;
+    }
+  }
+
+  /* They may also decide an if. */
+  if (IS_FUNCTION(n->type) && n->function == iffunc) {
+    const span cond = range_of(n->parameters[0]);
+    const int taken = (cond.min > 0 || cond.max < 0) ? 1 : (cond.min == 0 && cond.max == 0) ? 2 : 0;
+    if (taken && can_drop(n->parameters[0]) && can_drop(n->parameters[3 - taken])) {
+      tie_expression *ret = n->parameters[taken];
+      n->parameters[taken] = 0;
+      tie_free(n);
+      COUNT(folded_nodes, 1);
+      return ret;
+    }
+  }
+  return n;
+}
+
+static tie_expression *prepare(tie_expression *n) {
+  /* Folds constants, then records what the ranges prove. */
+  int narrow;
+  n = optimize(n);
+  annotate(n, &narrow);
+  return n;
+}
+
+
+static tie_expression *copy_expr(const tie_expression *n, const tie_variable *fixed, int fixed_count) {
+  /* Deep copy of n in which the variables listed in fixed become constants. */
+  const int arity = ARITY(n->type);
+  tie_expression *ret;
+  int i;
+
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) {
+    for (i = 0; i < fixed_count; ++i) {
+      if (fixed[i].address == n->bound) {
+        ret = new_expr(0, TIE_CONSTANT, 0);
+        CHECK_NULL(ret);
+        ret->value = load_value(n->bound, STORAGE(n->type));
+        return ret;
+      }
+    }
+  }
+
+  ret = new_expr(0, n->type, 0);
+  CHECK_NULL(ret);
+  memcpy(ret, n, expr_size(n->type));
+  if (n->type & TIE_FLAG_MEMO) __atomic_fetch_add(&((memo *) n->parameters[MEMO_SLOT(n->type)])->refs, 1, __ATOMIC_RELAXED);
+  for (i = 0; i < arity; ++i) {
+    ret->parameters[i] = copy_expr(n->parameters[i], fixed, fixed_count);
+    if (!ret->parameters[i]) {
+      while (i < arity) ret->parameters[i++] = 0;
+      tie_free(ret);
+      return NULL;
+    }
+  }
+  return ret;
+}
+
+
+tie_expression *tie_specialize(const tie_expression *n, const tie_variable *variables, int var_count) {
+  tie_expression *ret = copy_expr(n, variables, var_count);
+  CHECK_NULL(ret);
+  return prepare(ret);
+}
+
+
+/* Highest degree tie_eval_sweep works out by forward differences; each costs an addition per row. */
+#define MAX_DEGREE 8
+
+static const tie_expression *find_variable(const tie_expression *n, const int *var) {
+  int i;
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) return n->bound == var ? n : 0;
+  for (i = 0; i < ARITY(n->type); ++i) {
+    const tie_expression *found = find_variable(n->parameters[i], var);
+    if (found) return found;
+  }
+  return 0;
+}
+
+static int degree(const tie_expression *n, const int *var) {
+  /* Subtrees without var are constant over a sweep if they are pure. */
+  if (!find_variable(n, var)) return is_pure_tree(n) ? 0 : -1;
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) return 1;
+  if (!IS_FUNCTION(n->type)) return -1;
+
+  const void *f = n->function;
+  const int a = ARITY(n->type) > 0 ? degree(n->parameters[0], var) : -1;
+  const int b = ARITY(n->type) > 1 ? degree(n->parameters[1], var) : -1;
+  if (f == negate) return a;
+  if (a < 0 || b < 0) return -1;
+  if (f == add || f == sub) return a > b ? a : b;
+  if (f == mul) return a + b <= MAX_DEGREE ? a + b : -1;
+  return -1;
+}
+
+int tie_poly_degree(const tie_expression *n, const int *var) {
+  if (!n) return -1;
+  const tie_expression *v = find_variable(n, var);
+  if (v && STORAGE(v->type)) return -1;
+  return degree(n, var);
+}
+
+static int sweep_batch(const tie_expression *n, const int *var, int start, int step, int n_rows, int *out) {
+  /* Evaluates block by block with a column of var values made for each block. */
+  int xs[BATCH_BLOCK];
+  const tie_column columns[] = {{var, xs}, {0, 0}};
+  int first, i;
+
+  batch b = from_columns(columns);
+  tie_expression *hoisted = hoist(n, &b, n_rows);
+  if (hoisted) n = hoisted;
+  count_rows(n, n_rows);
+
+  const int slots = batch_slots(n), lets = batch_lets(n);
+  int *scratch = slots + lets ? malloc(sizeof(int) * BATCH_BLOCK * (slots + lets)) : 0;
+  if (slots + lets && !scratch) {
+    tie_free(hoisted);
+    return -1;
+  }
+
+  b.lets = lets ? scratch + BATCH_BLOCK * slots : 0;
+  for (first = 0; first < n_rows; first += BATCH_BLOCK) {
+    b.first = 0;
+    b.count = n_rows - first < BATCH_BLOCK ? n_rows - first : BATCH_BLOCK;
+    for (i = 0; i < b.count; ++i) xs[i] = (int) ((unsigned) start + (unsigned) (first + i) * (unsigned) step);
+    eval_block(n, &b, out + first, scratch);
+  }
+
+  free(scratch);
+  tie_free(hoisted);
+  return 0;
+}
+
+int tie_eval_sweep(const tie_expression *n, const int *var, int start, int step, int n_rows, int *out) {
+  /* A polynomial of degree d in var is also one of degree d in the row number, so its
+   * d-th differences are constant. The first d + 1 rows are evaluated and the rest follow
+   * by additions. Integer arithmetic wraps, and the differences wrap the same way, so the
+   * results are exact. */
+  unsigned diff[MAX_DEGREE + 1];
+  int i, j;
+
+  if (!n || n_rows < 0) return -1;
+  const tie_expression *v = find_variable(n, var);
+  if (v && STORAGE(v->type)) return -1;
+
+  const int d = degree(n, var);
+  if (d < 0 || n_rows <= d + 1) return sweep_batch(n, var, start, step, n_rows, out);
+  if (sweep_batch(n, var, start, step, d + 1, out)) return -1;
+
+  for (i = 0; i <= d; ++i) diff[i] = (unsigned) out[i];
+  for (j = 1; j <= d; ++j) {
+    for (i = d; i >= j; --i) diff[i] -= diff[i - 1];
+  }
+  /* diff[j] is now the j-th difference at row 0. */
+  for (i = 0; i < n_rows; ++i) {
+    out[i] = (int) diff[0];
+    for (j = 0; j < d; ++j) diff[j] += diff[j + 1];
+  }
+  return 0;
+}
+
+
+static unsigned long long hash_bytes(const char *key, int len) {
+  /* FNV-1a */
+  unsigned long long h = 14695981039346656037ull;
+  int i;
+  for (i = 0; i < len; ++i) {
+    h ^= (unsigned char) key[i];
+    h *= 1099511628211ull;
+  }
+  return h;
+}
+
+/* Fingerprints identify variables and functions by name where possible, so they
+ * do not depend on addresses and stay the same from one run to the next. */
+typedef struct canon {
+  const tie_variable *lookup;
+  int lookup_len;
+} canon;
+
+typedef struct operand {
+  tie_expression *node;
+  unsigned long long hash;
+} operand;
+
+static unsigned long long mix(unsigned long long h, unsigned long long v) {
+  h ^= v * 0x9E3779B97F4A7C15ull;
+  h = (h ^ (h >> 32)) * 0xD6E8FEB86659FD93ull;
+  return h ^ (h >> 32);
+}
+
+static unsigned long long name_hash(const char *name) {
+  return hash_bytes(name, strlen(name));
+}
+
+static unsigned long long variable_hash(const canon *c, const void *address) {
+  int i;
+  for (i = 0; i < c->lookup_len; ++i) {
+    if (TYPE_MASK(c->lookup[i].type) == TIE_VARIABLE && c->lookup[i].address == address) {
+      return name_hash(c->lookup[i].name);
+    }
+  }
+  return (unsigned long long) (size_t) address;
+}
+
+static unsigned long long node_hash(const tie_expression *n, const canon *c, const unsigned long long *params) {
+  const int arity = ARITY(n->type);
+  unsigned long long h = mix(0, TYPE_MASK(n->type));
+  int i;
+
+  if (TYPE_MASK(n->type) == TIE_CONSTANT) return mix(h, (unsigned) n->value);
+
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) return mix(h, variable_hash(c, n->bound));
+
+  if (n->type & TIE_FLAG_LET) {
+    /* Bindings and reads by slot, stores to output variables by the variable. */
+    h = mix(h, arity == 1 ? variable_hash(c, n->parameters[1]) : (unsigned long long) (size_t) n->parameters[arity]);
+    for (i = 0; i < arity; ++i) h = mix(h, params[i]);
+    return h;
+  }
+
+  unsigned long long id = (unsigned long long) (size_t) n->function;
+  for (i = 0; operators[i].function; ++i) {
+    if (operators[i].function == n->function) id = name_hash(operators[i].symbol);
+  }
+  for (i = 0; functions[i].name; ++i) {
+    if (functions[i].address == n->function) id = name_hash(functions[i].name);
+  }
+  for (i = 0; i < c->lookup_len; ++i) {
+    if (c->lookup[i].address == n->function && (!IS_CLOSURE(n->type) || c->lookup[i].context == n->parameters[arity])) {
+      id = name_hash(c->lookup[i].name);
+      break;
+    }
+  }
+
+  h = mix(h, id);
+  for (i = 0; i < arity; ++i) h = mix(h, params[i]);
+  return h;
+}
+
+static unsigned long long fingerprint(const tie_expression *n, const canon *c) {
+  unsigned long long params[7];
+  int i;
+  for (i = 0; i < ARITY(n->type); ++i) params[i] = fingerprint(n->parameters[i], c);
+  return node_hash(n, c, params);
+}
+
+static int is_reorderable(const void *f) {
+  /* Associative and commutative, so a chain of them can be put in any order. */
+  return f == add || f == mul || f == bitwise_and || f == bitwise_or || f == bitwise_xor || f == min || f == max;
+}
+
+static int in_chain(const tie_expression *n, const void *f) {
+  return IS_FUNCTION(n->type) && !(n->type & TIE_FLAG_BATCH) && ARITY(n->type) == 2 && n->function == f;
+}
+
+static int chain_length(const tie_expression *n, const void *f) {
+  if (!in_chain(n, f)) return 1;
+  return chain_length(n->parameters[0], f) + chain_length(n->parameters[1], f);
+}
+
+static void gather(tie_expression *n, const void *f, operand *operands, int *count, tie_expression **links, int *nlinks) {
+  if (!in_chain(n, f)) {
+    operands[(*count)++].node = n;
+    return;
+  }
+  links[(*nlinks)++] = n;
+  gather(n->parameters[0], f, operands, count, links, nlinks);
+  gather(n->parameters[1], f, operands, count, links, nlinks);
+}
+
+static int compare_operands(const void *a, const void *b) {
+  const operand *x = a, *y = b;
+  const int cx = TYPE_MASK(x->node->type) == TIE_CONSTANT, cy = TYPE_MASK(y->node->type) == TIE_CONSTANT;
+  if (cx != cy) return cx - cy;
+  return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+static int fold_constants(const void *f, int a, int b) {
+  int flags = 0;
+  if (f == add) return checked_add(a, b, &flags);
+  if (f == mul) return checked_mul(a, b, &flags);
+  return ((tie_fun2) f)(a, b);
+}
+
+static tie_expression *canonical(tie_expression *n, const canon *c, unsigned long long *hash) {
+  /* Rewrites n bottom-up. Chains of one reorderable operator are flattened, their
+   * operands sorted by fingerprint with constants last and merged, and then rebuilt
+   * left-deep from the same nodes. */
+  unsigned long long params[7];
+  const int arity = ARITY(n->type);
+  int i;
+
+  const void *f = IS_FUNCTION(n->type) ? n->function : 0;
+  const int length = (f && is_reorderable(f)) ? chain_length(n, f) : 0;
+  operand *operands = length > 2 ? malloc(sizeof(operand) * length) : 0;
+  tie_expression **links = operands ? malloc(sizeof(tie_expression *) * length) : 0;
+
+  if (!links) {
+    free(operands);
+    for (i = 0; i < arity; ++i) {
+      n->parameters[i] = canonical(n->parameters[i], c, &params[i]);
+    }
+    if (f && length == 2 && compare_operands(&(operand) {n->parameters[1], params[1]},
+                                             &(operand) {n->parameters[0], params[0]}) < 0) {
+      void *t = n->parameters[0];
+      unsigned long long th = params[0];
+      n->parameters[0] = n->parameters[1];
+      n->parameters[1] = t;
+      params[0] = params[1];
+      params[1] = th;
+    }
+    *hash = node_hash(n, c, params);
+    return n;
+  }
+
+  int count = 0, nlinks = 0;
+  gather(n, f, operands, &count, links, &nlinks);
+  for (i = 0; i < count; ++i) {
+    operands[i].node = canonical(operands[i].node, c, &operands[i].hash);
+  }
+  qsort(operands, count, sizeof(operand), compare_operands);
+
+  /* Constants sort last; merge them into the first one. */
+  int first = count;
+  while (first > 0 && TYPE_MASK(operands[first - 1].node->type) == TIE_CONSTANT) --first;
+  for (i = first + 1; i < count; ++i) {
+    operands[first].node->value = fold_constants(f, operands[first].node->value, operands[i].node->value);
+    tie_free(operands[i].node);
+  }
+  if (first < count) {
+    operands[first].hash = node_hash(operands[first].node, c, 0);
+    count = first + 1;
+  }
+
+  tie_expression *ret = operands[0].node;
+  unsigned long long h = operands[0].hash;
+  for (i = 1; i < count; ++i) {
+    tie_expression *link = links[i - 1];
+    link->parameters[0] = ret;
+    link->parameters[1] = operands[i].node;
+    params[0] = h;
+    params[1] = operands[i].hash;
+    h = node_hash(link, c, params);
+    ret = link;
+  }
+  for (i = count - 1; i < nlinks; ++i) {
+    links[i]->parameters[0] = links[i]->parameters[1] = 0;
+    tie_free(links[i]);
+  }
+
+  free(operands);
+  free(links);
+  *hash = h;
+  return ret;
+}
+
+
+tie_expression *tie_canonicalize(tie_expression *n, const tie_variable *variables, int var_count) {
+  canon c;
+  unsigned long long hash;
+  c.lookup = variables;
+  c.lookup_len = var_count;
+  return prepare(canonical(n, &c, &hash));
+}
+
+
+unsigned long long tie_fingerprint(const tie_expression *n, const tie_variable *variables, int var_count) {
+  canon c;
+  c.lookup = variables;
+  c.lookup_len = var_count;
+  return fingerprint(n, &c);
+}
+
+
+/* C code generation. Builtins are emitted as calls to helpers that match the
+ * library's own definitions, so generated code gives the same results. */
+static const char emit_helpers[] =
+    "#ifndef TIE_EMIT_HELPERS\n"
+    "#define TIE_EMIT_HELPERS\n"
+    "static inline int tie_abs(int a) { return (int) (a < 0 ? 0u - (unsigned) a : (unsigned) a); }\n"
+    "static inline int tie_bswap(int a) { return (int) __builtin_bswap32((unsigned) a); }\n"
+    "static inline int tie_clamp(int a, int lo, int hi) { return a < lo ? lo : a > hi ? hi : a; }\n"
+    "static inline int tie_clz(int a) { return a ? __builtin_clz((unsigned) a) : 32; }\n"
+    "static inline int tie_ctz(int a) { return a ? __builtin_ctz((unsigned) a) : 32; }\n"
+    "static inline int tie_max(int a, int b) { return a > b ? a : b; }\n"
+    "static inline int tie_min(int a, int b) { return a < b ? a : b; }\n"
+    "static inline int tie_popcount(int a) { return __builtin_popcount((unsigned) a); }\n"
+    "static inline int tie_rotl(int a, int b) { return (int) (((unsigned) a << (b & 31)) | ((unsigned) a >> (-b & 31))); }\n"
+    "static inline int tie_rotr(int a, int b) { return (int) (((unsigned) a >> (b & 31)) | ((unsigned) a << (-b & 31))); }\n"
+    "#endif\n\n";
+
+typedef struct emitter {
+  FILE *out;
+  const tie_variable *lookup;
+  int lookup_len;
+  const char *variable; /* printf format for variable i */
+} emitter;
+
+static int emit_variable(const emitter *e, const tie_expression *n) {
+  int i;
+  for (i = 0; i < e->lookup_len; ++i) {
+    if (TYPE_MASK(e->lookup[i].type) == TIE_VARIABLE && e->lookup[i].address == n->bound) return i;
+  }
+  return -1;
+}
+
+static const char *emit_function(const emitter *e, const tie_expression *n, int *builtin) {
+  int i;
+  *builtin = 1;
+  for (i = 0; functions[i].name; ++i) {
+    if (functions[i].address == n->function) return functions[i].name;
+  }
+  *builtin = 0;
+  for (i = 0; i < e->lookup_len; ++i) {
+    if (e->lookup[i].address == n->function && !IS_CLOSURE(e->lookup[i].type)) return e->lookup[i].name;
+  }
+  return 0;
+}
+
+static int emit_scan(const emitter *e, const tie_expression *n, unsigned char *used) {
+  /* Checks that n can be emitted and marks the variables it reads. */
+  const int arity = ARITY(n->type);
+  int i;
+
+  if (TYPE_MASK(n->type) == TIE_CONSTANT) return 0;
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) {
+    const int v = emit_variable(e, n);
+    if (v < 0) return -1;
+    used[v] = 1;
+    return 0;
+  }
+  if (IS_CLOSURE(n->type)) return -1;
+
+  for (i = 0; i < arity; ++i) {
+    if (emit_scan(e, n->parameters[i], used)) return -1;
+  }
+  for (i = 0; operators[i].function; ++i) {
+    if (operators[i].function == n->function) return 0;
+  }
+  int builtin;
+  return emit_function(e, n, &builtin) ? 0 : -1;
+}
+
+static void emit_declarations(const emitter *e, const tie_expression *n) {
+  /* Declares the custom functions n calls. */
+  const int arity = ARITY(n->type);
+  int i, builtin;
+
+  if (TYPE_MASK(n->type) == TIE_CONSTANT || TYPE_MASK(n->type) == TIE_VARIABLE) return;
+  for (i = 0; i < arity; ++i) emit_declarations(e, n->parameters[i]);
+  for (i = 0; operators[i].function; ++i) {
+    if (operators[i].function == n->function) return;
+  }
+  const char *name = emit_function(e, n, &builtin);
+  if (!builtin) {
+    fprintf(e->out, "int %s(", name);
+    for (i = 0; i < arity; ++i) fprintf(e->out, i ? ", int" : "int");
+    fprintf(e->out, arity ? ");\n" : "void);\n");
+  }
+}
+
+static void emit_node(const emitter *e, const tie_expression *n) {
+  const int arity = ARITY(n->type);
+  int i;
+
+  if (TYPE_MASK(n->type) == TIE_CONSTANT) {
+    if (n->value == INT_MIN) fprintf(e->out, "(-%d - 1)", INT_MAX);
+    else fprintf(e->out, n->value < 0 ? "(%d)" : "%d", n->value);
+    return;
+  }
+  if (TYPE_MASK(n->type) == TIE_VARIABLE) {
+    fprintf(e->out, e->variable, emit_variable(e, n));
+    return;
+  }
+
+  for (i = 0; operators[i].function; ++i) {
+    if (operators[i].function == n->function) {
+      fputc('(', e->out);
+      if (arity == 1) {
+        fputs(operators[i].symbol, e->out);
+        emit_node(e, n->parameters[0]);
+      } else {
+        emit_node(e, n->parameters[0]);
+        fprintf(e->out, " %s ", operators[i].symbol);
+        emit_node(e, n->parameters[1]);
+      }
+      fputc(')', e->out);
+      return;
+    }
+  }
+
+  if (n->function == iffunc) {
+    fputc('(', e->out);
+    emit_node(e, n->parameters[0]);
+    fputs(" ? ", e->out);
+    emit_node(e, n->parameters[1]);
+    fputs(" : ", e->out);
+    emit_node(e, n->parameters[2]);
+    fputc(')', e->out);
+    return;
+  }
+
+  int builtin;
+  const char *name = emit_function(e, n, &builtin);
+  fprintf(e->out, builtin ? "tie_%s(" : "%s(", name);
+  for (i = 0; i < arity; ++i) {
+    if (i) fputs(", ", e->out);
+    emit_node(e, n->parameters[i]);
+  }
+  fputc(')', e->out);
+}
+
+
+int tie_emit_c(const tie_expression *n, const char *name, const tie_variable *variables, int var_count, FILE *out) {
+  emitter e;
+  int i;
+
+  if (!n || !name || !out) return -1;
+  unsigned char *used = calloc(var_count > 0 ? var_count : 1, 1);
+  if (!used) return -1;
+
+  e.out = out;
+  e.lookup = variables;
+  e.lookup_len = var_count;
+  /* Nothing is written for an expression that cannot be emitted. */
+  if (emit_scan(&e, n, used)) {
+    free(used);
+    return -1;
+  }
+  fputs(emit_helpers, out);
+  emit_declarations(&e, n);
+
+  fprintf(out, "static inline int %s(const int *vars) {\n  return ", name);
+  e.variable = "vars[%d]";
+  emit_node(&e, n);
+  fputs(";\n}\n\n", out);
+
+  /* The batch version reads each column through its own restrict pointer, so the
+   * compiler is free to vectorize the loop. */
+  fprintf(out, "static inline void %s_batch(const int *const *columns, int *restrict out, int count) {\n", name);
+  for (i = 0; i < var_count; ++i) {
+    if (used[i]) fprintf(out, "  const int *restrict c%d = columns[%d];\n", i, i);
+  }
+  fputs("  int i;\n  for (i = 0; i < count; ++i) out[i] = ", out);
+  e.variable = "c%d[i]";
+  emit_node(&e, n);
+  fputs(";\n}\n\n", out);
+
+  free(used);
+  return ferror(out) ? -1 : 0;
+}
+
+
+static tie_expression *parse(state *s, const char *expression, int *error) {
+  s->start = s->next = expression;
+
+  next_token(s);
+  tie_expression *root = list(s);
+  if (root == NULL) {
+    /* Over a limit is reported like a syntax error at the point it was hit. */
+    if (error) *error = s->over_limit ? (s->next > s->start ? (int) (s->next - s->start) : 1) : -1;
+    return NULL;
+  }
+
+  if (s->type != END_TOKEN) {
+    discard(s, root);
+    if (error) {
+      *error = (s->next - s->start);
+      if (*error == 0) *error = 1;
+    }
+    return 0;
+  }
+  if (error) *error = 0;
+  return root;
+}
+
+tie_expression *tie_compile_limited(const char *expression, const tie_variable *variables, int var_count,
+                                    const tie_limits *limits, int *error) {
+  state s;
+  memset(&s, 0, sizeof(s));
+  s.lookup = variables;
+  s.lookup_len = var_count;
+  if (limits) s.limits = *limits;
+
+  tie_expression *root = parse(&s, expression, error);
+  COUNT(compiles, 1);
+  CHECK_NULL(root, COUNT(compile_failures, 1));
+  return prepare(root);
+}
+
+tie_expression *tie_compile(const char *expression, const tie_variable *variables, int var_count, int *error) {
+  return tie_compile_limited(expression, variables, var_count, 0, error);
+}
+
+static long long cost(const tie_expression *n, const tie_variable *variables, int var_count) {
+  const int arity = ARITY(n->type);
+  long long ret = 1;
+  int i;
+
+  if (IS_FUNCTION(n->type) || IS_CLOSURE(n->type)) {
+    for (i = 0; i < var_count; ++i) {
+      const tie_variable *v = &variables[i];
+      if (v->address == n->function && v->cost > 0 && (!IS_CLOSURE(n->type) || v->context == n->parameters[arity])) {
+        ret = v->cost;
+        break;
+      }
+    }
+  }
+  for (i = 0; i < arity; ++i) ret += cost(n->parameters[i], variables, var_count);
+  return ret;
+}
+
+long long tie_cost(const tie_expression *n, const tie_variable *variables, int var_count) {
+  return n ? cost(n, variables, var_count) : 0;
+}
+
+int tie_interp_buf(const char *expression, void *scratch, size_t size, int *error) {
+  /* The tree is not optimized, since folding frees nodes; it is only evaluated once. */
+  /* Nodes hold pointers, so the arena starts at the first pointer aligned byte. */
+  const size_t pad = -(uintptr_t) scratch & (sizeof(void *) - 1);
+  state s;
+  if (size < pad) {
+    if (error) *error = -1;
+    return 0;
+  }
+  memset(&s, 0, sizeof(s));
+  s.arena = (char *) scratch + pad;
+  s.arena_left = size - pad;
+
+  tie_expression *root = parse(&s, expression, error);
+  if (root == NULL) {
+    return 0;
+  }
+  return tie_eval(root);
+}
+
+int tie_interp(const char *expression, int *error) {
+  /* Most expressions fit on the stack; larger ones fall back to the heap. */
+  void *scratch[512];
+  int err;
+  const int ret = tie_interp_buf(expression, scratch, sizeof(scratch), &err);
+  if (err != -1) {
+    if (error) *error = err;
+    return ret;
+  }
+
+  tie_expression *n = tie_compile(expression, 0, 0, error);
+  if (n == NULL) {
+    return 0;
+  }
+
+  const int value = tie_eval(n);
+  tie_free(n);
+  return value;
+}
+
+
+/* Bulk compilation hands out expressions to threads one index at a time, so
+ * slow expressions do not hold up a whole share of the work. */
+typedef struct bulk {
+  const char *const *expressions;
+  int count;
+  const tie_variable *variables;
+  int var_count;
+  tie_expression **out;
+  int *errors;
+  int next;
+  int failed;
+} bulk;
+
+static void *bulk_worker(void *arg) {
+  bulk *b = arg;
+  int i, err, failed = 0;
+  while ((i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED)) < b->count) {
+    b->out[i] = tie_compile(b->expressions[i], b->variables, b->var_count, &err);
+    if (b->errors) b->errors[i] = err;
+    failed += !b->out[i];
+  }
+  __atomic_fetch_add(&b->failed, failed, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+int tie_compile_bulk(const char *const *expressions, int count, const tie_variable *variables, int var_count,
+                     int threads, tie_expression **out, int *errors) {
+  bulk b;
+  int i, started = 0;
+
+  if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > count) threads = count;
+  if (threads < 1) threads = 1;
+  pthread_t *pool = threads > 1 ? malloc(sizeof(pthread_t) * (threads - 1)) : 0;
+
+  b.expressions = expressions;
+  b.count = count;
+  b.variables = variables;
+  b.var_count = var_count;
+  b.out = out;
+  b.errors = errors;
+  b.next = 0;
+  b.failed = 0;
+
+  /* The calling thread works too, so the job finishes even if no thread starts. */
+  for (i = 0; pool && i < threads - 1; ++i) {
+    if (pthread_create(&pool[started], 0, bulk_worker, &b) == 0) ++started;
+  }
+  bulk_worker(&b);
+  for (i = 0; i < started; ++i) pthread_join(pool[i], 0);
+
+  free(pool);
+  return b.failed;
+}
+
+
+/* Subtrees of one tie_eval_parallel call that run on the pool. */
+#define MAX_TASKS 64
+
+typedef struct planner {
+  const tie_variable *variables;
+  int var_count;
+  long long min_cost;
+  int tasks;
+} planner;
+
+static int has_let(const tie_expression *n) {
+  /* Bindings live in thread-local slots, so subtrees using them stay on the calling thread. */
+  int i;
+  if (n->type & TIE_FLAG_LET) return 1;
+  for (i = 0; i < ARITY(n->type); ++i) {
+    if (has_let(n->parameters[i])) return 1;
+  }
+  return 0;
+}
+
+static int clear_tasks(tie_expression *n) {
+  /* Returns the number of tasks cleared. */
+  int i, ret = (n->type & TIE_FLAG_TASK) != 0;
+  n->type &= ~TIE_FLAG_TASK;
+  for (i = 0; i < ARITY(n->type); ++i) ret += clear_tasks(n->parameters[i]);
+  return ret;
+}
+
+static int plan_tasks(tie_expression *n, planner *p) {
+  /* Makes each child of n that costs at least min_cost a task, unless it splits into several
+   * tasks of its own. Returns the number of tasks in the subtree of n. */
+  int i, found = 0;
+  for (i = 0; i < ARITY(n->type); ++i) {
+    tie_expression *c = n->parameters[i];
+    if (cost(c, p->variables, p->var_count) < p->min_cost) continue;
+
+    const int inside = plan_tasks(c, p);
+    if (inside < 2 && !has_let(c) && p->tasks - inside < MAX_TASKS) {
+      p->tasks -= clear_tasks(c);
+      c->type |= TIE_FLAG_TASK;
+      ++p->tasks;
+      ++found;
+    } else {
+      found += inside;
+    }
+  }
+  return found;
+}
+
+int tie_parallelize(tie_expression *n, const tie_variable *variables, int var_count, long long min_cost) {
+  planner p;
+  if (!n) return 0;
+  clear_tasks(n);
+
+  p.variables = variables;
+  p.var_count = var_count;
+  p.min_cost = min_cost < 2 ? 2 : min_cost;
+  p.tasks = 0;
+  plan_tasks(n, &p);
+
+  /* A single task would only add a hand-off. */
+  if (p.tasks < 2) p.tasks -= clear_tasks(n);
+  return p.tasks;
+}
+
+
+/* A job holds the tasks of one tie_eval_parallel call. Pool threads and the calling
+ * thread take them one index at a time, like tie_compile_bulk. */
+typedef struct job {
+  struct job *next;
+  const tie_expression **tasks;
+  int *results;
+  int count;
+  int next_task;
+  int active; /* Pool threads working on the job. */
+} job;
+
+struct tie_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;     /* A job was queued, or the pool is stopping. */
+  pthread_cond_t finished; /* A pool thread left a job. */
+  job *queue;              /* Jobs that may have tasks left. */
+  int stopping;
+  int threads;
+  pthread_t workers[];
+};
+
+static void run_tasks(job *j) {
+  int i;
+  while ((i = __atomic_fetch_add(&j->next_task, 1, __ATOMIC_RELAXED)) < j->count) {
+    j->results[i] = eval_node(j->tasks[i]);
+  }
+}
+
+static void unqueue(tie_pool *pool, job *j) {
+  job **at;
+  for (at = &pool->queue; *at; at = &(*at)->next) {
+    if (*at == j) {
+      *at = j->next;
+      return;
+    }
+  }
+}
+
+static void *pool_worker(void *arg) {
+  tie_pool *pool = arg;
+  if (!local_stats.linked) link_stats();
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->queue && !pool->stopping) pthread_cond_wait(&pool->work, &pool->lock);
+    if (!pool->queue) break;
+
+    job *j = pool->queue;
+    ++j->active;
+    pthread_mutex_unlock(&pool->lock);
+    run_tasks(j);
+    pthread_mutex_lock(&pool->lock);
+
+    /* Every task has been taken once run_tasks returns. */
+    unqueue(pool, j);
+    if (--j->active == 0) pthread_cond_broadcast(&pool->finished);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+tie_pool *tie_pool_new(int threads) {
+  if (threads <= 0) threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads < 1) threads = 1;
+
+  tie_pool *pool = malloc(sizeof(tie_pool) + sizeof(pthread_t) * threads);
+  CHECK_NULL(pool);
+  pool->queue = 0;
+  pool->stopping = 0;
+  pool->threads = 0;
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->work, 0);
+  pthread_cond_init(&pool->finished, 0);
+
+  while (pool->threads < threads && pthread_create(&pool->workers[pool->threads], 0, pool_worker, pool) == 0) {
+    ++pool->threads;
+  }
+  if (pool->threads == 0) {
+    tie_pool_free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void tie_pool_free(tie_pool *pool) {
+  int i;
+  if (!pool) return;
+
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  for (i = 0; i < pool->threads; ++i) pthread_join(pool->workers[i], 0);
+
+  pthread_cond_destroy(&pool->finished);
+  pthread_cond_destroy(&pool->work);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+static void collect_tasks(const tie_expression *n, const tie_expression **tasks, int *count) {
+  int i;
+  if (n->type & TIE_FLAG_TASK) {
+    tasks[(*count)++] = n;
+    return;
+  }
+  for (i = 0; i < ARITY(n->type); ++i) collect_tasks(n->parameters[i], tasks, count);
+}
+
+static int eval_joined(const tie_expression *n, const int *results, int *next) {
+  /* Evaluates n like tie_eval, taking the value of each task from results. Tasks are met
+   * in the order collect_tasks found them. */
+  const int arity = ARITY(n->type);
+  int a[7];
+  int i;
+
+  if (n->type & TIE_FLAG_TASK) return results[(*next)++];
+  if (arity == 0) return eval_node(n);
+
+  if ((n->type & TIE_FLAG_LET) && arity == 2) {
+    int *value = &let_values[(size_t) n->parameters[2]];
+    const int outer = *value;
+    *value = eval_joined(n->parameters[0], results, next);
+    const int ret = eval_joined(n->parameters[1], results, next);
+    *value = outer;
+    return ret;
+  }
+
+  for (i = 0; i < arity; ++i) a[i] = eval_joined(n->parameters[i], results, next);
+  return call_function(n, a);
+}
+
+int tie_eval_parallel(const tie_expression *n, tie_pool *pool) {
+  const tie_expression *tasks[MAX_TASKS];
+  int results[MAX_TASKS];
+  int count = 0, next = 0;
+  job j;
+
+  if (!n) return 0;
+  collect_tasks(n, tasks, &count);
+  if (!pool || count < 2) return tie_eval(n);
+  COUNT_EVALUATION();
+
+  j.tasks = tasks;
+  j.results = results;
+  j.count = count;
+  j.next_task = 0;
+  j.active = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  j.next = pool->queue;
+  pool->queue = &j;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+
+  /* The calling thread takes tasks too, so the job finishes even when the pool is busy. */
+  run_tasks(&j);
+
+  pthread_mutex_lock(&pool->lock);
+  unqueue(pool, &j);
+  while (j.active) pthread_cond_wait(&pool->finished, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+
+  return eval_joined(n, results, &next);
+}
+
+
+static void pn(const tie_expression *n, int depth) {
+  int i, arity;
+  printf("%*s", depth, "");
+
+  switch (TYPE_MASK(n->type)) {
+    case TIE_CONSTANT:
+      printf("%d\n", n->value);
+      break;
+    case TIE_VARIABLE:
+      printf("bound %p\n", n->bound);
+      break;
+
+    case TIE_FUNCTION0:
+    case TIE_FUNCTION1:
+    case TIE_FUNCTION2:
+    case TIE_FUNCTION3:
+    case TIE_FUNCTION4:
+    case TIE_FUNCTION5:
+    case TIE_FUNCTION6:
+    case TIE_FUNCTION7:
+    case TIE_CLOSURE0:
+    case TIE_CLOSURE1:
+    case TIE_CLOSURE2:
+    case TIE_CLOSURE3:
+    case TIE_CLOSURE4:
+    case TIE_CLOSURE5:
+    case TIE_CLOSURE6:
+    case TIE_CLOSURE7:
+      arity = ARITY(n->type);
+      printf("f%d", arity);
+      for (i = 0; i < arity; i++) {
+        printf(" %p", n->parameters[i]);
+      }
+      printf("\n");
+      for (i = 0; i < arity; i++) {
+        pn(n->parameters[i], depth + 1);
+      }
+      break;
+  }
+}
+
+
+void tie_print(const tie_expression *n) {
+  pn(n, 0);
+}
+
+
+/* Epochs let readers walk shared structures without taking a lock. Readers
+ * register in the counter of the current epoch; a writer that has unlinked
+ * something advances the epoch and waits for the old counter to drain before
+ * releasing it. Writers must be serialized by the caller. Reader counts are
+ * striped over cache lines so that many threads do not fight over one. */
+#define EPOCH_STRIPES 16
+
+typedef struct epoch_stripe {
+  unsigned readers[2];
+} __attribute__((aligned(64))) epoch_stripe;
+
+typedef struct epoch {
+  unsigned current;
+  epoch_stripe stripes[EPOCH_STRIPES];
+} epoch;
+
+static int thread_stripe(void) {
+  static unsigned next_stripe;
+  static __thread int stripe = -1;
+  if (stripe < 0) stripe = __atomic_fetch_add(&next_stripe, 1, __ATOMIC_RELAXED) % EPOCH_STRIPES;
+  return stripe;
+}
+
+static unsigned epoch_enter(epoch *e) {
+  unsigned *readers = e->stripes[thread_stripe()].readers;
+  for (;;) {
+    const unsigned now = __atomic_load_n(&e->current, __ATOMIC_SEQ_CST);
+    __atomic_fetch_add(&readers[now & 1], 1, __ATOMIC_SEQ_CST);
+    /* If a writer moved on in between it may not have seen us. */
+    if (__atomic_load_n(&e->current, __ATOMIC_SEQ_CST) == now) return now;
+    __atomic_fetch_sub(&readers[now & 1], 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+static void epoch_leave(epoch *e, unsigned token) {
+  __atomic_fetch_sub(&e->stripes[thread_stripe()].readers[token & 1], 1, __ATOMIC_RELEASE);
+}
+
+static void epoch_synchronize(epoch *e) {
+  const unsigned old = __atomic_fetch_add(&e->current, 1, __ATOMIC_SEQ_CST);
+  int i;
+  for (i = 0; i < EPOCH_STRIPES; ++i) {
+    while (__atomic_load_n(&e->stripes[i].readers[old & 1], __ATOMIC_SEQ_CST)) sched_yield();
+  }
+}
+
+
+struct tie_cache_entry {
+  tie_cache_entry *next;
+  tie_cache_entry *newer;
+  unsigned long long hash;
+  int refs;
+  int used; /* Hit since it last came up for eviction. */
+  tie_expression *expression;
+  char key[1];
+};
+
+typedef struct cache_counters {
+  unsigned long long hits;
+  unsigned long long misses;
+} __attribute__((aligned(64))) cache_counters;
+
+struct tie_cache {
+  epoch epoch;
+  cache_counters counters[EPOCH_STRIPES];
+
+  const tie_variable *variables;
+  int var_count;
+
+  /* Everything below is only written with lock held. */
+  pthread_mutex_t lock;
+  tie_cache_entry **buckets;
+  unsigned bucket_mask;
+  tie_cache_entry *oldest;
+  tie_cache_entry *newest;
+  int size;
+  int capacity;
+  unsigned long long evictions;
+};
+
+#define IS_WORD(c) (isalnum((unsigned char) (c)) || (c) == '_' || (c) == '.')
+#define IS_JOINABLE(c) ((c) != 0 && strchr("<>=!&|", (c)) != 0)
+
+static int normalize(const char *expression, char *out, int size) {
+  /* Drops whitespace that cannot change the meaning of the expression.
+   * Returns the normalized length, which may be larger than size. */
+  const char *c;
+  int len = 0;
+  char prev = 0;
+  for (c = expression; *c; ++c) {
+    if (isspace((unsigned char) *c)) {
+      while (isspace((unsigned char) c[1])) ++c;
+      if (!c[1]) break;
+      if (!((IS_WORD(prev) && IS_WORD(c[1])) || (IS_JOINABLE(prev) && IS_JOINABLE(c[1])))) continue;
+    }
+    if (len < size) out[len] = isspace((unsigned char) *c) ? ' ' : *c;
+    prev = *c;
+    ++len;
+  }
+  return len;
+}
+
+#undef IS_WORD
+#undef IS_JOINABLE
+
+tie_cache *tie_cache_new(const tie_variable *variables, int var_count, int capacity) {
+  tie_cache *c;
+  unsigned buckets = 16;
+
+  if (capacity < 1) return 0;
+  while (buckets < (unsigned) capacity * 2) buckets *= 2;
+
+  if (posix_memalign((void **) &c, 64, sizeof(tie_cache))) return 0;
+  memset(c, 0, sizeof(tie_cache));
+  c->buckets = calloc(buckets, sizeof(tie_cache_entry *));
+  if (!c->buckets) {
+    free(c);
+    return 0;
+  }
+
+  pthread_mutex_init(&c->lock, 0);
+  c->bucket_mask = buckets - 1;
+  c->capacity = capacity;
+  c->variables = variables;
+  c->var_count = var_count;
+  return c;
+}
+
+static tie_cache_entry *cache_find(tie_cache *c, const char *key, int len, unsigned long long hash) {
+  tie_cache_entry *e = __atomic_load_n(&c->buckets[hash & c->bucket_mask], __ATOMIC_ACQUIRE);
+  for (; e; e = __atomic_load_n(&e->next, __ATOMIC_ACQUIRE)) {
+    if (e->hash == hash && strncmp(e->key, key, len) == 0 && e->key[len] == '\0') return e;
+  }
+  return 0;
+}
+
+static void cache_evict(tie_cache *c) {
+  /* Unlinks the least recently used entry, then drops the cache's reference once no reader
+   * can reach it. Hits only set a flag, so that they take no lock: an oldest entry that was
+   * hit since it last came up is moved to the newest end instead (a second chance). */
+  tie_cache_entry *victim = c->oldest;
+  int i;
+  for (i = 0; i < c->size && victim != c->newest && __atomic_load_n(&victim->used, __ATOMIC_RELAXED); ++i) {
+    __atomic_store_n(&victim->used, 0, __ATOMIC_RELAXED);
+    c->oldest = victim->newer;
+    victim->newer = 0;
+    c->newest->newer = victim;
+    c->newest = victim;
+    victim = c->oldest;
+  }
+
+  tie_cache_entry **link = &c->buckets[victim->hash & c->bucket_mask];
+  while (*link != victim) link = &(*link)->next;
+  __atomic_store_n(link, victim->next, __ATOMIC_RELEASE);
+
+  c->oldest = victim->newer;
+  if (!c->oldest) c->newest = 0;
+  --c->size;
+  ++c->evictions;
+
+  epoch_synchronize(&c->epoch);
+  tie_cache_release(victim);
+}
+
+tie_cache_entry *tie_cache_acquire(tie_cache *c, const char *expression, int *error) {
+  char buffer[512];
+  char *key = buffer;
+  cache_counters *counters = &c->counters[thread_stripe()];
+
+  int len = normalize(expression, buffer, sizeof(buffer));
+  if (len >= (int) sizeof(buffer)) {
+    key = malloc(len + 1);
+    if (!key) {
+      if (error) *error = -1;
+      return 0;
+    }
+    normalize(expression, key, len);
+  }
+  key[len] = '\0';
+  const unsigned long long hash = hash_bytes(key, len);
+
+  const unsigned token = epoch_enter(&c->epoch);
+  tie_cache_entry *e = cache_find(c, key, len, hash);
+  if (e) {
+    __atomic_fetch_add(&e->refs, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&e->used, 1, __ATOMIC_RELAXED);
+  }
+  epoch_leave(&c->epoch, token);
+
+  if (e) {
+    __atomic_fetch_add(&counters->hits, 1, __ATOMIC_RELAXED);
+    COUNT(cache_hits, 1);
+    if (key != buffer) free(key);
+    if (error) *error = 0;
+    return e;
+  }
+  __atomic_fetch_add(&counters->misses, 1, __ATOMIC_RELAXED);
+  COUNT(cache_misses, 1);
+
+  /* Compile outside the lock; another thread may race us to the same key. */
+  tie_expression *n = tie_compile(expression, c->variables, c->var_count, error);
+  e = n ? malloc(sizeof(tie_cache_entry) + len) : 0;
+  if (!e) {
+    if (n && error) *error = -1;
+    tie_free(n);
+    if (key != buffer) free(key);
+    return 0;
+  }
+
+  memcpy(e->key, key, len + 1);
+  if (key != buffer) free(key);
+  e->hash = hash;
+  e->expression = n;
+  e->newer = 0;
+  e->used = 0;
+  e->refs = 2; /* the cache and the caller */
+
+  pthread_mutex_lock(&c->lock);
+  tie_cache_entry *existing = cache_find(c, e->key, len, hash);
+  if (existing) {
+    __atomic_fetch_add(&existing->refs, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&c->lock);
+    tie_free(n);
+    free(e);
+    return existing;
+  }
+
+  if (c->size == c->capacity) cache_evict(c);
+
+  tie_cache_entry **bucket = &c->buckets[hash & c->bucket_mask];
+  e->next = *bucket;
+  __atomic_store_n(bucket, e, __ATOMIC_RELEASE);
+  if (c->newest) c->newest->newer = e;
+  else c->oldest = e;
+  c->newest = e;
+  ++c->size;
+  pthread_mutex_unlock(&c->lock);
+  return e;
+}
+
+const tie_expression *tie_cache_expression(const tie_cache_entry *e) {
+  return e->expression;
+}
+
+void tie_cache_release(tie_cache_entry *e) {
+  if (!e) return;
+  if (__atomic_sub_fetch(&e->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    tie_free(e->expression);
+    free(e);
+  }
+}
+
+void tie_cache_get_stats(tie_cache *c, tie_cache_stats *stats) {
+  int i;
+  memset(stats, 0, sizeof(tie_cache_stats));
+  for (i = 0; i < EPOCH_STRIPES; ++i) {
+    stats->hits += __atomic_load_n(&c->counters[i].hits, __ATOMIC_RELAXED);
+    stats->misses += __atomic_load_n(&c->counters[i].misses, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_lock(&c->lock);
+  stats->evictions = c->evictions;
+  stats->size = c->size;
+  pthread_mutex_unlock(&c->lock);
+}
+
+void tie_cache_free(tie_cache *c) {
+  if (!c) return;
+  while (c->oldest) {
+    tie_cache_entry *e = c->oldest;
+    c->oldest = e->newer;
+    tie_cache_release(e);
+  }
+  pthread_mutex_destroy(&c->lock);
+  free(c->buckets);
+  free(c);
+}
+
+
+struct tie_handle {
+  epoch epoch;
+  tie_expression *current;
+  pthread_mutex_t lock; /* Serializes writers. */
+};
+
+tie_handle *tie_handle_new(tie_expression *initial) {
+  tie_handle *h;
+  /* The epoch stripes are cache line aligned, which calloc does not promise. */
+  if (posix_memalign((void **) &h, 64, sizeof(tie_handle))) return NULL;
+  memset(h, 0, sizeof(tie_handle));
+  if (pthread_mutex_init(&h->lock, 0)) {
+    free(h);
+    return NULL;
+  }
+  h->current = initial;
+  return h;
+}
+
+const tie_expression *tie_handle_enter(tie_handle *h, unsigned *token) {
+  *token = epoch_enter(&h->epoch);
+  return __atomic_load_n(&h->current, __ATOMIC_SEQ_CST);
+}
+
+void tie_handle_leave(tie_handle *h, unsigned token) {
+  epoch_leave(&h->epoch, token);
+}
+
+void tie_handle_publish(tie_handle *h, tie_expression *next) {
+  pthread_mutex_lock(&h->lock);
+  tie_expression *old = __atomic_exchange_n(&h->current, next, __ATOMIC_SEQ_CST);
+  /* Readers that may still see old entered before the epoch moves on. */
+  epoch_synchronize(&h->epoch);
+  pthread_mutex_unlock(&h->lock);
+  tie_free(old);
+}
+
+int tie_handle_eval(tie_handle *h) {
+  unsigned token;
+  const tie_expression *n = tie_handle_enter(h, &token);
+  const int ret = n ? tie_eval(n) : 0;
+  tie_handle_leave(h, token);
+  return ret;
+}
+
+void tie_handle_free(tie_handle *h) {
+  if (!h) return;
+  pthread_mutex_destroy(&h->lock);
+  tie_free(h->current);
+  free(h);
 }
 
 #pragma clang diagnostic pop
\ No newline at end of file
@@ -2,6 +2,8 @@
 #define TINYINTEGEREXPR_H
 
 
+#include <stdio.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -27,29 +29,298 @@ enum {
   TIE_CLOSURE0 = 16, TIE_CLOSURE1, TIE_CLOSURE2, TIE_CLOSURE3,
   TIE_CLOSURE4, TIE_CLOSURE5, TIE_CLOSURE6, TIE_CLOSURE7,
 
-  TIE_FLAG_PURE = 32
+  TIE_FLAG_PURE = 32,
+  TIE_FLAG_MEMO = 64, /* Remember recent results by argument. Only for functions whose result depends on nothing else. */
+  TIE_FLAG_OUTPUT = 128 /* On variables: may be assigned with "name = value". The variable must be a writable int. */
+};
+
+/* Optional block version of a function: out[i] = f(args[0][i], ..., args[arity-1][i]) for i < count. */
+/* context is the closure context (0 for functions), and out never overlaps args. */
+typedef void (*tie_batch_function)(void *context, const int *const *args, int *out, int count);
+
+/* Integer types that values can be loaded from. They are converted to int like a cast. */
+enum {
+  TIE_INT32 = 0,
+  TIE_INT8,
+  TIE_UINT8,
+  TIE_INT16,
+  TIE_UINT16,
+  TIE_UINT32,
+  TIE_INT64
 };
 
+/* Values a variable can take. Declared through the variable's range; */
+/* the range must outlive compiled expressions, like the variable itself. */
+typedef struct tie_range {
+  int min;
+  int max;
+} tie_range;
+
 typedef struct tie_variable {
   const char *name;
   const void *address;
   int type;
   void *context;
+  tie_batch_function batch;
+  int cost; /* Relative cost of a call for tie_cost; 0 counts as 1. */
+  int storage; /* For variables: type of the value at address, TIE_INT32 (0), TIE_UINT8, ... */
+  const tie_range *range; /* For variables: the values it can take, or 0 if unknown. */
 } tie_variable;
 
 
+/* Upper bounds for tie_compile_limited. 0 means no limit. */
+typedef struct tie_limits {
+  int max_tokens;
+  int max_depth; /* Nesting of parentheses, function calls and unary operators. */
+  int max_nodes;
+} tie_limits;
+
+/* Error conditions reported by the checked evaluators. */
+enum {
+  TIE_ERROR_OVERFLOW = 1,
+  TIE_ERROR_DIVIDE = 2,
+  TIE_ERROR_SHIFT = 4,
+  TIE_ERROR_INVALID = 8 /* A node that cannot be evaluated, such as one of an unknown type. */
+};
+
+/* Feeds the field at offset bytes into each record to the variable bound at address bound. */
+/* Lists of fields end with an entry whose bound is 0. */
+typedef struct tie_field {
+  const void *bound;
+  size_t offset;
+  int type; /* TIE_INT32, TIE_UINT8, ... */
+} tie_field;
+
+/* Feeds one value per row to the variable bound at address bound. data holds values of the */
+/* variable's storage type. Lists of columns end with an entry whose bound is 0. */
+typedef struct tie_column {
+  const void *bound;
+  const void *data;
+} tie_column;
+
+
 
 /* Parses the input expression, evaluates it, and frees it. */
-/* Returns NaN on error. */
+/* Returns 0 and sets *error on error. */
 int tie_interp(const char *expression, int *error);
 
+/* Like tie_interp, but builds the expression in the size bytes at scratch instead of allocating. */
+/* scratch needs no particular alignment; up to sizeof(void *) - 1 bytes at its start are skipped */
+/* to align the nodes. Returns 0 and sets *error to -1 if scratch is too small. */
+int tie_interp_buf(const char *expression, void *scratch, size_t size, int *error);
+
 /* Parses the input expression and binds variables. */
 /* Returns NULL on error. */
 tie_expression *tie_compile(const char *expression, const tie_variable *variables, int var_count, int *error);
 
+/* Like tie_compile, but fails when the expression exceeds the limits. *error is then set */
+/* to the position where a limit was hit. limits may be NULL. */
+tie_expression *tie_compile_limited(const char *expression, const tie_variable *variables, int var_count,
+                                    const tie_limits *limits, int *error);
+
+/* Estimated cost of evaluating the expression: one per node, or the cost registered in */
+/* variables for calls to custom functions. */
+long long tie_cost(const tie_expression *n, const tie_variable *variables, int var_count);
+
+/* Compiles count expressions on up to threads threads (0 for one per core) into out, and */
+/* sets errors[i] like the error of tie_compile (errors may be 0). The variables are shared */
+/* by all threads and only read. Returns the number of expressions that failed to compile. */
+int tie_compile_bulk(const char *const *expressions, int count, const tie_variable *variables, int var_count,
+                     int threads, tie_expression **out, int *errors);
+
+/* Returns a new expression in which the listed variables are replaced by their current values */
+/* and folded away. The original is left untouched. Returns NULL on error. */
+tie_expression *tie_specialize(const tie_expression *n, const tie_variable *variables, int var_count);
+
+/* Rewrites the expression into a canonical form: operands of + * & | ^ min max are reordered */
+/* and their constants merged. Consumes n and returns the new root. */
+tie_expression *tie_canonicalize(tie_expression *n, const tie_variable *variables, int var_count);
+
+/* Structural hash of the expression. Variables and functions are hashed by name when they */
+/* appear in the list, so equal canonical expressions fingerprint the same across runs. */
+unsigned long long tie_fingerprint(const tie_expression *n, const tie_variable *variables, int var_count);
+
 /* Evaluates the expression. */
 int tie_eval(const tie_expression *n);
 
+/* Range of values the expression can produce, given the ranges declared for its variables. */
+tie_range tie_get_range(const tie_expression *n);
+
+/* Evaluates the expression without trapping on overflow, division by zero or bad shifts. */
+/* Sets *error to the TIE_ERROR_* conditions that were hit, 0 if none. */
+int tie_eval_checked(const tie_expression *n, int *error);
+
+/* Evaluates the expression for n_rows rows into out. Variables without a column keep their bound value. */
+/* Returns 0, or -1 when out of memory. */
+int tie_eval_batch(const tie_expression *n, const tie_column *columns, int n_rows, int *out);
+
+/* Checked version of tie_eval_batch. Bit (row % 8) of error_mask[row / 8] is set for each row */
+/* that hit an error (error_mask may be 0). Returns the TIE_ERROR_* conditions of all rows, or -1. */
+int tie_eval_batch_checked(const tie_expression *n, const tie_column *columns, int n_rows, int *out,
+                           unsigned char *error_mask);
+
+/* Evaluates the expression like tie_eval_batch for n_rows records of stride bytes each, starting */
+/* at base. The variables listed in fields are read from each record. Returns 0, or -1 when out of memory. */
+int tie_eval_records(const tie_expression *n, const void *base, size_t stride, const tie_field *fields,
+                     int n_rows, int *out);
+
+/* Evaluates the expression as a filter over n_rows rows. Bit (row % 8) of bitmap[row / 8] */
+/* is set for rows where it is non-zero. Returns the number of such rows, or -1 on error. */
+int tie_eval_bitmap(const tie_expression *n, const tie_column *columns, int n_rows, unsigned char *bitmap);
+
+/* Evaluates the expression for the n_rows row numbers in rows (all rows up to n_rows when rows */
+/* is 0) and writes the row numbers where it is non-zero to selected, which may be rows itself. */
+/* Returns the number of rows selected, or -1 on error. */
+int tie_eval_select(const tie_expression *n, const tie_column *columns, const int *rows, int n_rows,
+                    int *selected);
+
+/* Reductions for tie_eval_reduce. COUNT counts rows where the expression is non-zero. */
+enum {
+  TIE_REDUCE_SUM,
+  TIE_REDUCE_MIN,
+  TIE_REDUCE_MAX,
+  TIE_REDUCE_COUNT,
+  TIE_REDUCE_ANY,
+  TIE_REDUCE_ALL
+};
+
+/* Evaluates the expression for n_rows rows like tie_eval_batch and returns the TIE_REDUCE_* */
+/* reduction op of the results, without storing them. Returns LLONG_MIN on error. */
+long long tie_eval_reduce(const tie_expression *n, const tie_column *columns, int n_rows, int op);
+
+/* Evaluates the expression for n_rows rows like tie_eval_batch and writes the k rows with the */
+/* highest results to out_idx and their results to out_val, best first (earlier rows first */
+/* among equal results). Returns the number of rows written, min(k, n_rows), or -1 on error. */
+int tie_eval_topk(const tie_expression *n, const tie_column *columns, int n_rows, int k, int *out_idx, int *out_val);
+
+/* Degree of the expression as a polynomial in the int variable at var, built with + - * from */
+/* var, constants and pure subtrees not using var. Returns -1 if it is not one or the degree is over 8. */
+int tie_poly_degree(const tie_expression *n, const int *var);
+
+/* Writes the results for var = start, start + step, ... to out[0] ... out[n_rows - 1], like */
+/* tie_eval_batch with a column for var. Polynomials in var take a few additions per row. */
+/* var must be an int variable. Returns 0, or -1 on error. */
+int tie_eval_sweep(const tie_expression *n, const int *var, int start, int step, int n_rows, int *out);
+
+/* One group of tie_group_aggregate. */
+typedef struct tie_group {
+  int key;
+  int rows;
+  long long value;
+} tie_group;
+
+/* Evaluates key and value for n_rows rows like tie_eval_batch and aggregates the values of */
+/* the rows with the same key with the TIE_REDUCE_* op. value may be NULL for TIE_REDUCE_COUNT */
+/* to count rows. Uses up to threads threads (0 for one per core) on large inputs. Sets *groups */
+/* to an array sorted by key, to be freed with free(), and returns its length, or -1 on error. */
+int tie_group_aggregate(const tie_expression *key, const tie_expression *value, const tie_column *columns,
+                        int n_rows, int op, int threads, tie_group **groups);
+
+/* A thread-safe cache of compiled expressions, keyed on the expression text with */
+/* insignificant whitespace removed. Lookups take no locks. */
+typedef struct tie_cache tie_cache;
+typedef struct tie_cache_entry tie_cache_entry;
+
+typedef struct tie_cache_stats {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+  int size;
+} tie_cache_stats;
+
+/* Creates a cache holding up to capacity expressions compiled against variables, */
+/* which must outlive the cache. When full it evicts the least recently used expression, */
+/* approximately (second chance). Returns NULL on error. */
+tie_cache *tie_cache_new(const tie_variable *variables, int var_count, int capacity);
+
+/* Returns a reference to the compiled expression, compiling it on a miss. */
+/* Returns NULL and sets *error like tie_compile on failure. */
+tie_cache_entry *tie_cache_acquire(tie_cache *cache, const char *expression, int *error);
+
+/* The compiled expression of an acquired entry. It stays valid until the entry is released. */
+const tie_expression *tie_cache_expression(const tie_cache_entry *entry);
+
+/* Drops a reference from tie_cache_acquire. Evicted expressions are freed with their last reference. */
+void tie_cache_release(tie_cache_entry *entry);
+
+void tie_cache_get_stats(tie_cache *cache, tie_cache_stats *stats);
+
+/* Frees the cache. Entries still acquired stay valid until released. */
+void tie_cache_free(tie_cache *cache);
+
+/* A compiled expression that can be replaced while other threads evaluate it. Readers take */
+/* no locks; replaced expressions are freed once no reader can still be using them. */
+typedef struct tie_handle tie_handle;
+
+/* Creates a handle owning initial (which may be NULL). Returns NULL on error. */
+tie_handle *tie_handle_new(tie_expression *initial);
+
+/* Returns the current expression, which stays valid until the matching tie_handle_leave. */
+const tie_expression *tie_handle_enter(tie_handle *h, unsigned *token);
+
+void tie_handle_leave(tie_handle *h, unsigned token);
+
+/* Makes next the current expression, taking ownership of it, and frees the previous one */
+/* after the readers using it have left. Must not be called between enter and leave. */
+void tie_handle_publish(tie_handle *h, tie_expression *next);
+
+/* Evaluates the current expression. Returns 0 if there is none. */
+int tie_handle_eval(tie_handle *h);
+
+/* Frees the handle and its expression. No thread may be using it. */
+void tie_handle_free(tie_handle *h);
+
+/* Worker threads for tie_eval_parallel, kept running between calls. */
+typedef struct tie_pool tie_pool;
+
+/* Starts threads threads (0 for one per core). Returns NULL on error. */
+tie_pool *tie_pool_new(int threads);
+
+/* Stops the threads. No tie_eval_parallel call may be using the pool. */
+void tie_pool_free(tie_pool *pool);
+
+/* Marks the independent subtrees of n that cost at least min_cost by tie_cost, such as */
+/* calls to slow closures, to be run concurrently by tie_eval_parallel. Subtrees using */
+/* bindings are not split off. Returns the number of subtrees, or 0 if there are fewer than two. */
+int tie_parallelize(tie_expression *n, const tie_variable *variables, int var_count, long long min_cost);
+
+/* Evaluates the subtrees marked by tie_parallelize on the pool and in the calling thread, */
+/* then the rest of the expression. Without a pool it runs serially like tie_eval. */
+/* Returns 0 if n is NULL. */
+int tie_eval_parallel(const tie_expression *n, tie_pool *pool);
+
+/* Writes C source for the expression to out: static inline int name(const int *vars), where */
+/* vars[i] is the value of variables[i], and name_batch(columns, out, count) for columns of rows. */
+/* Custom functions are called by name. Returns 0, or -1 if the expression uses closures or */
+/* variables and functions missing from the list. */
+int tie_emit_c(const tie_expression *n, const char *name, const tie_variable *variables, int var_count, FILE *out);
+
+/* Calls of TIE_FLAG_MEMO functions answered from the memo (hits) or made (misses). */
+typedef struct tie_memo_stats {
+  unsigned long long hits;
+  unsigned long long misses;
+} tie_memo_stats;
+
+/* Adds up the memo statistics of all functions in the expression. */
+void tie_memo_get_stats(const tie_expression *n, tie_memo_stats *stats);
+
+/* Library-wide counters, over all threads since the program started. */
+typedef struct tie_stats {
+  unsigned long long compiles;         /* tie_compile calls, including failed ones. */
+  unsigned long long compile_failures;
+  unsigned long long nodes_allocated;  /* Expression nodes allocated on the heap. */
+  long long bytes_live;                /* Heap bytes held by expression nodes now. */
+  unsigned long long evaluations;      /* Evaluation calls; each row of a batch counts as one. */
+  unsigned long long nodes_evaluated;  /* By batches; by single evaluations only with TIE_NODE_STATS. */
+  double nodes_per_evaluation;        /* Over batch rows, and single evaluations with TIE_NODE_STATS. */
+  unsigned long long folded_nodes;     /* Nodes replaced by constants while compiling. */
+  unsigned long long cache_hits;       /* Of all tie_caches. */
+  unsigned long long cache_misses;
+} tie_stats;
+
+/* Adds up the counters of all threads. Threads count without locks or atomic operations. */
+void tie_get_stats(tie_stats *stats);
+
 /* Prints debugging information on the syntax tree. */
 void tie_print(const tie_expression *n);
 